@@ -0,0 +1,257 @@
+//
+// buffer_chain.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2012 Xu Ye Jun (moore.xu@gmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BAS_BUFFER_CHAIN_HPP
+#define BAS_BUFFER_CHAIN_HPP
+
+#include <boost/asio/buffer.hpp>
+#include <boost/assert.hpp>
+#include <boost/noncopyable.hpp>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include <bas/slab_pool.hpp>
+
+namespace bas {
+
+/// Buffer for incoming and outcoming data, chained by fixed-size blocks from slab_pool.
+///   It grows without moving data, and exposes data as buffer sequences for scatter/gather i/o:
+///     handler.async_read_some(chain.prepare(length)) ... chain.produce(bytes_transferred);
+///     handler.async_write(chain.data()) ... chain.consume(bytes_transferred);
+class buffer_chain
+  : private boost::noncopyable
+{
+public:
+  /// The type of the bytes stored in buffer_chain.
+  typedef unsigned char byte_t;
+
+  /// Define type reference of std::size_t.
+  typedef std::size_t size_t;
+
+  /// The type of buffer sequence of unread data.
+  typedef std::vector<boost::asio::const_buffer> const_buffers_type;
+
+  /// The type of buffer sequence of free space.
+  typedef std::vector<boost::asio::mutable_buffer> mutable_buffers_type;
+
+  /// Constructor.
+  explicit buffer_chain(slab_pool& pool = slab_pool::global())
+    : pool_(pool),
+      segments_(),
+      size_(0)
+  {
+  }
+
+  /// Destruct the buffer, put back all blocks.
+  ~buffer_chain()
+  {
+    clear();
+  }
+
+  /// Clear the buffer and put back all blocks.
+  void clear()
+  {
+    for (size_t i = 0; i < segments_.size(); ++i)
+      pool_.deallocate(segments_[i].data);
+
+    segments_.clear();
+    size_ = 0;
+  }
+
+  /// Is there no unread data in the buffer.
+  bool empty() const
+  {
+    return size_ == 0;
+  }
+
+  /// Return the amount of unread data in the buffer.
+  size_t size() const
+  {
+    return size_;
+  }
+
+  /// Return the amount of free space in the allocated blocks.
+  size_t space() const
+  {
+    size_t space = 0;
+    for (size_t i = segments_.size(); i > 0 && segments_[i - 1].end != pool_.slab_size(); --i)
+    {
+      space += pool_.slab_size() - segments_[i - 1].end;
+      if (segments_[i - 1].end != 0)
+        break;
+    }
+
+    return space;
+  }
+
+  /// Return buffers of the unread data.
+  const_buffers_type data() const
+  {
+    const_buffers_type buffers;
+    for (size_t i = 0; i < segments_.size() && segments_[i].end != segments_[i].begin; ++i)
+      buffers.push_back(boost::asio::const_buffer(segments_[i].data + segments_[i].begin,
+                                                  segments_[i].end - segments_[i].begin));
+
+    return buffers;
+  }
+
+  /// Return buffers of free space for the specified length, allocate blocks if necessary.
+  mutable_buffers_type prepare(size_t length)
+  {
+    // Allocate blocks for the space.
+    for (size_t space = this->space(); space < length; space += pool_.slab_size())
+      push_segment();
+
+    mutable_buffers_type buffers;
+    for (size_t i = first_space(); length != 0; ++i)
+    {
+      segment& s = segments_[i];
+      size_t n = pool_.slab_size() - s.end;
+      if (n > length)
+        n = length;
+
+      buffers.push_back(boost::asio::mutable_buffer(s.data + s.end, n));
+      length -= n;
+    }
+
+    return buffers;
+  }
+
+  /// Produce multiple bytes written to the buffers returned by prepare.
+  void produce(size_t count)
+  {
+    BOOST_ASSERT(count <= space());
+
+    size_ += count;
+    for (size_t i = first_space(); count != 0; ++i)
+    {
+      segment& s = segments_[i];
+      size_t n = pool_.slab_size() - s.end;
+      if (n > count)
+        n = count;
+
+      s.end += n;
+      count -= n;
+    }
+  }
+
+  /// Produce data to the ending of the buffer.
+  void produce(size_t length, const byte_t* data)
+  {
+    mutable_buffers_type buffers = prepare(length);
+    for (size_t i = 0; i < buffers.size(); ++i)
+    {
+      size_t n = boost::asio::buffer_size(buffers[i]);
+      std::memcpy(boost::asio::buffer_cast<byte_t*>(buffers[i]), data, n);
+      data += n;
+    }
+
+    produce(length);
+  }
+
+  /// Consume multiple bytes from the beginning of the buffer, put back the blocks consumed.
+  ///   Only full blocks are put back and the write position never moves back,
+  ///   the free space of the last block may be prepared for a pending read.
+  void consume(size_t count)
+  {
+    BOOST_ASSERT(count <= size());
+
+    size_ -= count;
+    while (count != 0)
+    {
+      segment& s = segments_.front();
+      size_t n = s.end - s.begin;
+      if (n > count)
+      {
+        s.begin += count;
+        break;
+      }
+
+      count -= n;
+      s.begin = s.end;
+
+      // The block is still being written, keep it.
+      if (s.end != pool_.slab_size())
+      {
+        BOOST_ASSERT(count == 0);
+        break;
+      }
+
+      pool_.deallocate(s.data);
+      segments_.pop_front();
+    }
+  }
+
+  /// Copy data from the beginning of the buffer, return the bytes copied.
+  size_t copy(size_t length, byte_t* data) const
+  {
+    size_t copied = 0;
+    for (size_t i = 0; i < segments_.size() && copied < length; ++i)
+    {
+      size_t n = segments_[i].end - segments_[i].begin;
+      if (n > length - copied)
+        n = length - copied;
+
+      std::memcpy(data + copied, segments_[i].data + segments_[i].begin, n);
+      copied += n;
+    }
+
+    return copied;
+  }
+
+private:
+  /// A block with the range of unread data.
+  struct segment
+  {
+    byte_t* data;
+    size_t begin;
+    size_t end;
+  };
+
+  /// Allocate a block to the ending of the buffer.
+  void push_segment()
+  {
+    segment s;
+    s.data = static_cast<byte_t*>(pool_.allocate());
+    s.begin = 0;
+    s.end = 0;
+
+    segments_.push_back(s);
+  }
+
+  /// Get the index of the first block with free space.
+  size_t first_space() const
+  {
+    size_t i = segments_.size();
+    while (i > 0 && segments_[i - 1].end != pool_.slab_size())
+    {
+      --i;
+      if (segments_[i].end != 0)
+        break;
+    }
+
+    return i;
+  }
+
+private:
+  /// The pool of blocks.
+  slab_pool& pool_;
+
+  /// The blocks of the buffer.
+  std::deque<segment> segments_;
+
+  /// The amount of unread data.
+  size_t size_;
+};
+
+} // namespace bas
+
+#endif // BAS_BUFFER_CHAIN_HPP
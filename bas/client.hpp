@@ -15,6 +15,7 @@
 #include <boost/noncopyable.hpp>
 
 #include <bas/io_service_pool.hpp>
+#include <bas/io_service_group.hpp>
 #include <bas/service_handler.hpp>
 #include <bas/service_handler_pool.hpp>
 
@@ -29,13 +30,13 @@ public:
   /// Define type reference of boost::asio::io_service.
   typedef boost::asio::io_service io_service_t;
 
-  /// Define type reference of boost::asio::ip::tcp::endpoint.
-  typedef boost::asio::ip::tcp::endpoint endpoint_t;
-
   /// The type of the service_handler.
   typedef service_handler<Work_Handler, Socket_Service> service_handler_t;
   typedef boost::shared_ptr<service_handler_t> service_handler_ptr;
 
+  /// The type of the endpoint of the socket protocol.
+  typedef typename service_handler_t::endpoint_t endpoint_t;
+
   /// The type of the service_handler_pool.
   typedef service_handler_pool<Work_Handler, Work_Allocator, Socket_Service> service_handler_pool_t;
   typedef boost::shared_ptr<service_handler_pool_t> service_handler_pool_ptr;
@@ -45,8 +46,8 @@ public:
       endpoint_t& peer_endpoint = endpoint_t(),
       endpoint_t& local_endpoint = endpoint_t())
     : service_handler_pool_(service_handler_pool),
-      peer_endpoint_(peer_endpoint),
-      local_endpoint_(local_endpoint)
+      local_endpoint_(local_endpoint),
+      peer_endpoint_(peer_endpoint)
   {
     BOOST_ASSERT(service_handler_pool_.get() != 0);
 
@@ -169,6 +170,33 @@ public:
     return connect(io_service, work_service, data, peer_endpoint_, local_endpoint_);
   }
 
+  /// Establish a connection with io_service and work_service chosen from the given io_service_group.
+  ///   Works of high priority are executed by the priority_pool of io_service_group if it has one.
+  bool connect(io_service_group& service_group,
+      io_service_group::priority_t priority = io_service_group::normal_priority)
+  {
+    io_service_t* io_service = 0;
+    io_service_t* work_service = 0;
+    choose(service_group, priority, io_service, work_service);
+
+    // Connect with the internal endpoint.
+    return connect(*io_service, *work_service, peer_endpoint_, local_endpoint_);
+  }
+
+  /// Establish a connection with io_service and work_service chosen from the given io_service_group and per_conection_data.
+  template<typename Per_connection_data>
+  bool connect(io_service_group& service_group,
+      Per_connection_data& data,
+      io_service_group::priority_t priority = io_service_group::normal_priority)
+  {
+    io_service_t* io_service = 0;
+    io_service_t* work_service = 0;
+    choose(service_group, priority, io_service, work_service);
+
+    // Connect with the internal endpoint.
+    return connect(*io_service, *work_service, data, peer_endpoint_, local_endpoint_);
+  }
+
   /// Establish a connection with the given parent_handler.
   template<typename Parent_Handler>
   bool connect(Parent_Handler& parent_handler)
@@ -187,6 +215,24 @@ public:
   }
 
 private:
+  /// Choose io_service and work_service from the io_service_group with the policy of each pool.
+  ///   The work_service is chosen on the same NUMA node of the io_service if possible.
+  ///   Non-blocking work handlers run in io_service thread, the work_pool is skipped.
+  void choose(io_service_group& service_group,
+      io_service_group::priority_t priority,
+      io_service_t*& io_service,
+      io_service_t*& work_service)
+  {
+    io_service_pool& io_pool = service_group.get(io_service_group::io_pool);
+    io_service = &io_pool.get_io_service();
+
+    if (work_handler_traits<Work_Handler>::non_blocking::value)
+      work_service = io_service;
+    else
+      work_service = &service_group.get_lane(priority).get_io_service(service_handler_pool_->get_load(),
+          io_pool.get_node(*io_service));
+  }
+
   /// The pool of service_handler objects.
   service_handler_pool_ptr service_handler_pool_;
 
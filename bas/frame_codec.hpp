@@ -0,0 +1,214 @@
+//
+// frame_codec.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2012 Xu Ye Jun (moore.xu@gmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BAS_FRAME_CODEC_HPP
+#define BAS_FRAME_CODEC_HPP
+
+#include <boost/assert.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <string>
+
+namespace bas {
+
+/// A decoded frame in read_buffer.
+struct frame_t
+{
+  /// The beginning of the frame.
+  const unsigned char* data;
+
+  /// The size of the frame.
+  std::size_t size;
+};
+
+/// Define type reference of frame_t.
+typedef frame_t frame;
+
+/// Base class of codecs for splitting incoming data into frames.
+class frame_codec
+{
+public:
+  /// The type of the bytes decoded.
+  typedef unsigned char byte_t;
+
+  /// Define type reference of std::size_t.
+  typedef std::size_t size_t;
+
+  /// The frame size returned for invalid data.
+  static const size_t invalid_frame = static_cast<size_t>(-1);
+
+  /// Destructor.
+  virtual ~frame_codec()
+  {
+  }
+
+  /// Get the size of the frame at the beginning of data.
+  ///   Return 0 if the size is unknown yet, invalid_frame if data is invalid.
+  ///   The size returned may be larger than size if the frame is incomplete.
+  virtual size_t frame_size(const byte_t* data, size_t size) const = 0;
+};
+
+/// Define type reference of frame_codec pointer.
+typedef boost::shared_ptr<frame_codec> frame_codec_ptr;
+
+/// Codec for frames with a fixed size.
+class fixed_codec
+  : public frame_codec
+{
+public:
+  /// Constructor.
+  explicit fixed_codec(size_t frame_size)
+    : frame_size_(frame_size)
+  {
+    BOOST_ASSERT(frame_size != 0);
+  }
+
+  /// Get the size of the frame at the beginning of data.
+  virtual size_t frame_size(const byte_t* /*data*/, size_t /*size*/) const
+  {
+    return frame_size_;
+  }
+
+private:
+  /// The size of each frame.
+  size_t frame_size_;
+};
+
+/// Codec for frames with a length field in the header.
+///   The frame size is the value of the length field plus adjustment,
+///   e.g. adjustment is the header size if the length does not include the header.
+class length_codec
+  : public frame_codec
+{
+public:
+  /// Constructor.
+  length_codec(size_t field_offset,
+      size_t field_size,
+      boost::int64_t adjustment = 0,
+      bool big_endian = true,
+      size_t max_frame_size = 0)
+    : field_offset_(field_offset),
+      field_size_(field_size),
+      adjustment_(adjustment),
+      big_endian_(big_endian),
+      max_frame_size_(max_frame_size)
+  {
+    BOOST_ASSERT(field_size != 0 && field_size <= sizeof(boost::uint64_t));
+  }
+
+  /// Get the size of the frame at the beginning of data.
+  virtual size_t frame_size(const byte_t* data, size_t size) const
+  {
+    // The length field is incomplete.
+    if (size < field_offset_ + field_size_)
+      return 0;
+
+    boost::uint64_t length = 0;
+    for (size_t i = 0; i < field_size_; ++i)
+    {
+      size_t index = big_endian_ ? i : field_size_ - 1 - i;
+      length = (length << 8) | data[field_offset_ + index];
+    }
+
+    // Reject lengths above the maximum before adjusting, so nothing overflows.
+    boost::uint64_t limit = (max_frame_size_ != 0) ? max_frame_size_ : (std::numeric_limits<size_t>::max)() - 1;
+    boost::uint64_t frame = length;
+    if (adjustment_ >= 0)
+    {
+      boost::uint64_t adjustment = static_cast<boost::uint64_t>(adjustment_);
+      if (length > limit || adjustment > limit - length)
+        return invalid_frame;
+
+      frame += adjustment;
+    }
+    else
+    {
+      boost::uint64_t adjustment = static_cast<boost::uint64_t>(-(adjustment_ + 1)) + 1;
+      if (length < adjustment || length - adjustment > limit)
+        return invalid_frame;
+
+      frame -= adjustment;
+    }
+
+    // The frame must contain the length field.
+    if (frame < field_offset_ + field_size_)
+      return invalid_frame;
+
+    return static_cast<size_t>(frame);
+  }
+
+private:
+  /// The offset of the length field.
+  size_t field_offset_;
+
+  /// The size of the length field in bytes.
+  size_t field_size_;
+
+  /// The value added to the length field to get the frame size.
+  boost::int64_t adjustment_;
+
+  /// Flag to indicate the length field is big endian.
+  bool big_endian_;
+
+  /// The maximum size of a frame, 0 for no limit.
+  size_t max_frame_size_;
+};
+
+/// Codec for frames terminated by a delimiter, the frame includes the delimiter.
+class delimiter_codec
+  : public frame_codec
+{
+public:
+  /// Constructor.
+  explicit delimiter_codec(const std::string& delimiter,
+      size_t max_frame_size = 0)
+    : delimiter_(delimiter),
+      max_frame_size_(max_frame_size)
+  {
+    BOOST_ASSERT(!delimiter.empty());
+  }
+
+  /// Get the size of the frame at the beginning of data.
+  virtual size_t frame_size(const byte_t* data, size_t size) const
+  {
+    const byte_t* first = reinterpret_cast<const byte_t*>(delimiter_.data());
+    const byte_t* last = first + delimiter_.size();
+
+    const byte_t* found = std::search(data, data + size, first, last);
+    if (found != data + size)
+    {
+      size_t frame = static_cast<size_t>(found - data) + delimiter_.size();
+      if (max_frame_size_ != 0 && frame > max_frame_size_)
+        return invalid_frame;
+
+      return frame;
+    }
+
+    // The delimiter is not found in the maximum frame size.
+    if (max_frame_size_ != 0 && size >= max_frame_size_)
+      return invalid_frame;
+
+    return 0;
+  }
+
+private:
+  /// The delimiter of frames.
+  std::string delimiter_;
+
+  /// The maximum size of a frame, 0 for no limit.
+  size_t max_frame_size_;
+};
+
+} // namespace bas
+
+#endif // BAS_FRAME_CODEC_HPP
@@ -0,0 +1,130 @@
+//
+// handler_allocator.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2012 Xu Ye Jun (moore.xu@gmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BAS_HANDLER_ALLOCATOR_HPP
+#define BAS_HANDLER_ALLOCATOR_HPP
+
+#include <boost/aligned_storage.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+
+namespace bas {
+
+#define BAS_HANDLER_MEMORY_SIZE  256
+
+/// Class to manage the memory to be used for handler-based custom allocation.
+///   It contains a single block of memory which may be returned for allocation requests.
+///   If the memory is in use when an allocation request is made, the allocator delegates allocation to the global heap.
+class handler_allocator
+  : private boost::noncopyable
+{
+public:
+  /// Constructor.
+  handler_allocator()
+    : in_use_(0)
+  {
+  }
+
+  /// Allocate memory for a handler, can be call from any thread.
+  void* allocate(std::size_t size)
+  {
+    // Try to take the block, give it back if it is in use.
+    if (size <= sizeof(storage_))
+    {
+      if (++in_use_ == 1)
+        return storage_.address();
+
+      --in_use_;
+    }
+
+    return ::operator new(size);
+  }
+
+  /// Deallocate memory of a handler, can be call from any thread.
+  void deallocate(void* pointer)
+  {
+    if (pointer == storage_.address())
+      --in_use_;
+    else
+      ::operator delete(pointer);
+  }
+
+private:
+  /// Storage space used for handler-based custom memory allocation.
+  boost::aligned_storage<BAS_HANDLER_MEMORY_SIZE> storage_;
+
+  /// Count to indicate whether the handler memory is currently in use.
+  boost::detail::atomic_count in_use_;
+};
+
+/// Wrapper class template for handler objects to allow handler memory allocation to be customised.
+///   Calls to operator() are forwarded to the encapsulated handler.
+template<typename Handler>
+class custom_alloc_handler
+{
+public:
+  /// Constructor.
+  custom_alloc_handler(handler_allocator& allocator, Handler handler)
+    : allocator_(allocator),
+      handler_(handler)
+  {
+  }
+
+  void operator()()
+  {
+    handler_();
+  }
+
+  template<typename Arg1>
+  void operator()(Arg1 arg1)
+  {
+    handler_(arg1);
+  }
+
+  template<typename Arg1, typename Arg2>
+  void operator()(Arg1 arg1, Arg2 arg2)
+  {
+    handler_(arg1, arg2);
+  }
+
+  /// Allocation hook found by asio with argument-dependent lookup.
+  friend void* asio_handler_allocate(std::size_t size,
+      custom_alloc_handler<Handler>* this_handler)
+  {
+    return this_handler->allocator_.allocate(size);
+  }
+
+  /// Deallocation hook found by asio with argument-dependent lookup.
+  friend void asio_handler_deallocate(void* pointer, std::size_t /*size*/,
+      custom_alloc_handler<Handler>* this_handler)
+  {
+    this_handler->allocator_.deallocate(pointer);
+  }
+
+private:
+  /// The allocator of the handler memory.
+  handler_allocator& allocator_;
+
+  /// The encapsulated handler.
+  Handler handler_;
+};
+
+/// Helper function to wrap a handler object to add custom allocation.
+template<typename Handler>
+inline custom_alloc_handler<Handler> make_custom_alloc_handler(handler_allocator& allocator,
+    Handler handler)
+{
+  return custom_alloc_handler<Handler>(allocator, handler);
+}
+
+} // namespace bas
+
+#endif // BAS_HANDLER_ALLOCATOR_HPP
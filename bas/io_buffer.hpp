@@ -16,12 +16,16 @@
 #define BAS_IO_BUFFER_HPP
 
 #include <boost/assert.hpp>
+#include <cstring>
 #include <memory>
-#include <vector>
+
+#include <bas/slab_pool.hpp>
 
 namespace bas {
 
 /// Buffer for incoming and outcoming data.
+///   The storage is borrowed from slab_pool when data() is first used. clear() and consume() only reset the offsets,
+///   for pending operations may still use the storage. It is put back by shrink() when the owner is idle.
 class io_buffer
 {
 public:
@@ -33,58 +37,88 @@ public:
 
   /// Default constructor.
   io_buffer(size_t capacity)
-    : buffer_(capacity, 0),
-      begin_offset_(0),
-      end_offset_(0)
+    : begin_offset_(0),
+      end_offset_(0),
+      buffer_(0),
+      capacity_(capacity)
   {
   }
 
   /// Constructor with the specified data.
   io_buffer(size_t length, byte_t* data)
-    : buffer_(length, 0),
-      begin_offset_(0),
-      end_offset_(length)
+    : begin_offset_(0),
+      end_offset_(length),
+      buffer_(0),
+      capacity_(length)
   {
     BOOST_ASSERT(data != 0);
 
-    memcpy(&buffer_[0], data, length);
+    memcpy(storage(), data, length);
   }
 
   /// Copy constructor.
   io_buffer(const io_buffer& other)
-    : buffer_(other.buffer_),
-      begin_offset_(other.begin_offset_),
-      end_offset_(other.end_offset_)
+    : begin_offset_(other.begin_offset_),
+      end_offset_(other.end_offset_),
+      buffer_(0),
+      capacity_(other.capacity_)
   {
+    if (other.buffer_ != 0)
+      memcpy(storage(), other.buffer_, capacity_);
   }
 
   /// Assign from another.
   io_buffer& operator= (const io_buffer& other)
   {
-    buffer_ = other.buffer_;
-    begin_offset_ = other.begin_offset_;
-    end_offset_ = other.end_offset_;
+    if (this != &other)
+    {
+      release();
+
+      capacity_ = other.capacity_;
+      begin_offset_ = other.begin_offset_;
+      end_offset_ = other.end_offset_;
+
+      if (other.buffer_ != 0)
+        memcpy(storage(), other.buffer_, capacity_);
+    }
 
     return *this;
   }
 
-  /// Clear the buffer.
+  /// Destruct the buffer, put back the storage.
+  ~io_buffer()
+  {
+    release();
+  }
+
+  /// Clear the buffer, the storage is kept.
   void clear()
   {
     begin_offset_ = 0;
     end_offset_ = 0;
   }
 
-  /// Return a pointer to the beginning of the unread data.
+  /// Put back the storage to slab_pool if the buffer is empty.
+  ///   Call it only when no operation is using the buffer, for example when the connection is closed.
+  void shrink()
+  {
+    if (empty())
+    {
+      clear();
+      release();
+    }
+  }
+
+  /// Return a pointer to the beginning of the unread data, borrow the storage if necessary.
   byte_t* data()
   {
-    return &buffer_[0] + begin_offset_;
+    return storage() + begin_offset_;
   }
 
   /// Return a pointer to the beginning of the unread data.
   const byte_t* data() const
   {
-    return &buffer_[0] + begin_offset_;
+    return buffer_ + begin_offset_;
   }
 
   /// Is there no unread data in the buffer.
@@ -108,7 +142,7 @@ public:
       end_offset_ = begin_offset_ + length;
     else
     {
-      memmove(&buffer_[0], &buffer_[0] + begin_offset_, size());
+      memmove(storage(), storage() + begin_offset_, size());
       end_offset_ = length;
       begin_offset_ = 0;
     }
@@ -117,7 +151,7 @@ public:
   /// Return the maximum size for data in the buffer.
   size_t capacity() const
   {
-    return buffer_.size();
+    return capacity_;
   }
 
   /// Return the amount of free space in the buffer.
@@ -149,7 +183,7 @@ public:
   {
     BOOST_ASSERT(length <= space());
 
-    memcpy(&buffer_[0] + end_offset_, data, length);
+    memcpy(storage() + end_offset_, data, length);
     end_offset_ += length;
   }
 
@@ -169,13 +203,33 @@ public:
         clear();
       else
       {
-        memmove(&buffer_[0], &buffer_[0] + begin_offset_, size());
+        memmove(storage(), storage() + begin_offset_, size());
         end_offset_ = size();
         begin_offset_ = 0;
       }
     }
   }
 
+private:
+  /// Get the storage, borrow it from slab_pool if not yet.
+  byte_t* storage()
+  {
+    if (buffer_ == 0 && capacity_ != 0)
+      buffer_ = static_cast<byte_t*>(slab_pool::global().allocate(capacity_));
+
+    return buffer_;
+  }
+
+  /// Put back the storage to slab_pool.
+  void release()
+  {
+    if (buffer_ != 0)
+    {
+      slab_pool::global().deallocate(buffer_, capacity_);
+      buffer_ = 0;
+    }
+  }
+
 private:
   /// The offset to the beginning of the unread data.
   size_t begin_offset_;
@@ -183,8 +237,11 @@ private:
   /// The offset to the end of the unread data.
   size_t end_offset_;
   
-  /// The data in the buffer.
-  std::vector<byte_t> buffer_;
+  /// The storage of the buffer, 0 if not borrowed.
+  byte_t* buffer_;
+
+  /// The maximum size for data in the buffer.
+  size_t capacity_;
 };
 
 } // namespace bas
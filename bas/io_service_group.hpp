@@ -12,12 +12,20 @@
 #define BAS_IO_SERVICE_GROUP_HPP
 
 #include <boost/assert.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
 #include <bas/io_service_pool.hpp>
+#include <bas/thread_affinity.hpp>
+#include <algorithm>
 #include <vector>
 
 namespace bas {
 
+#define BAS_IO_SERVICE_GROUP_DRAIN_TIMEOUT   0
+#define BAS_IO_SERVICE_GROUP_DRAIN_INTERVAL  100
+
 /// Class for holding multi io_service_pool.
 class io_service_group
   : private boost::noncopyable
@@ -29,19 +37,36 @@ public:
   /// Define shared_ptr type of io_service_pool.
   typedef boost::shared_ptr<io_service_pool> io_service_pool_ptr;
 
+  /// Define type of the handler for reporting progress of draining, called with the number of outstanding operations.
+  typedef boost::function<void (size_t)> drain_handler_t;
+
   /// Define index used by server class.
+  ///   The priority_pool is optional, it exists when group_size > priority_pool.
   enum index_t
   {
     io_pool = 0,
-    work_pool = 1
+    work_pool = 1,
+    priority_pool = 2
+  };
+
+  /// Define priority of the works of a connection.
+  enum priority_t
+  {
+    /// Works are executed by work_pool.
+    normal_priority = 0,
+
+    /// Works are executed by priority_pool, never queued after works of normal priority.
+    high_priority
   };
 
   /// Constructor.
   io_service_group(size_t group_size = work_pool + 1,
       bool force_stop = false)
     : io_service_pools_(),
+      started_(false),
       force_stop_(force_stop),
-      started_(false)
+      drain_handler_(),
+      drain_timeout_(BAS_IO_SERVICE_GROUP_DRAIN_TIMEOUT)
   {
     BOOST_ASSERT(group_size > work_pool);
 
@@ -68,6 +93,70 @@ public:
     return *this;
   }
 
+  /// Set parameters for graceful stop.
+  ///   Outstanding operations are drained in drain_timeout seconds, then the group is stopped in force mode.
+  ///   drain_timeout = 0 means waiting until all operations finished. drain_handler is called for reporting progress.
+  io_service_group& set_drain(unsigned int drain_timeout,
+      const drain_handler_t& drain_handler = drain_handler_t())
+  {
+    if (!started_)
+    {
+      drain_timeout_ = drain_timeout;
+      drain_handler_ = drain_handler;
+    }
+
+    return *this;
+  }
+
+  /// Bind threads of all io_service_pool to processors.
+  ///   Thread i of every io_service_pool is placed on the same NUMA node, but on different processors if possible,
+  ///   so the io_pool thread and the work_pool thread of a connection can share the same memory node.
+  io_service_group& set_affinity()
+  {
+    if (started_)
+      return *this;
+
+    thread_affinity::nodes_t nodes = thread_affinity::nodes();
+
+    size_t node_count = nodes.size();
+    size_t max_processors = 0;
+    for (size_t i = 0; i < node_count; ++i)
+      max_processors = (std::max)(max_processors, nodes[i].size());
+
+    size_t pool_count = io_service_pools_.size();
+    for (size_t pool = 0; pool < pool_count; ++pool)
+    {
+      // Thread k is placed on node k % node_count, each pool starts from a different processor of the node.
+      std::vector<int> processors;
+      for (size_t k = 0; k < node_count * max_processors; ++k)
+      {
+        const thread_affinity::processors_t& node = nodes[k % node_count];
+        size_t offset = pool * node.size() / pool_count;
+        processors.push_back(node[(k / node_count + offset) % node.size()]);
+      }
+
+      io_service_pools_[pool]->set_affinity(processors);
+    }
+
+    return *this;
+  }
+
+  /// Add io_service_pool objects until the group has group_size of them, the group must not be started.
+  io_service_group& extend(size_t group_size)
+  {
+    if (!started_)
+      while (io_service_pools_.size() < group_size)
+        io_service_pools_.push_back(io_service_pool_ptr(new io_service_pool(1, 1)));
+
+    return *this;
+  }
+
+  /// Get the number of io_service_pool objects.
+  size_t size() const
+  {
+    return io_service_pools_.size();
+  }
+
   /// Get specified io_service_pool to use.
   io_service_pool& get(size_t index)
   {
@@ -76,6 +165,16 @@ public:
     return *io_service_pools_[index];
   }
 
+  /// Get the io_service_pool used to perform works of the given priority.
+  ///   Works of high priority use priority_pool if the group has it, otherwise work_pool.
+  io_service_pool& get_lane(priority_t priority)
+  {
+    if (priority == high_priority && io_service_pools_.size() > priority_pool)
+      return *io_service_pools_[priority_pool];
+
+    return *io_service_pools_[work_pool];
+  }
+
   /// Get started status of the io_service_group.
   bool started() const
   {
@@ -88,6 +187,13 @@ public:
     if (started_)
       return;
 
+    // Handlers of io_pool are not serialized by strand, stealing or sharing would run i/o handlers of a connection
+    //   in more than one thread at the same time. Only work pools can use stealing_model and shared_model.
+    io_service_pool& pool = *io_service_pools_[io_pool];
+    BOOST_ASSERT(pool.get_model() == io_service_pool::single_model);
+    if (pool.get_model() != io_service_pool::single_model)
+      pool.set_model(io_service_pool::single_model);
+
     // Start all io_service_pool with non-blocked mode.
     for (size_t i = io_service_pools_.size(); i > 0; --i)
       io_service_pools_[i - 1]->start();
@@ -101,33 +207,53 @@ public:
     if (!started_)
       return;
 
+    // For gracefully close, wait for outstanding operations to finish while all threads are running.
+    //   If not finished before the deadline, stop in force mode.
+    bool force = force_stop_ || !drain();
+
     // Stop all io_service_pool.
     for (size_t i = io_service_pools_.size(); i > 0; --i)
-      io_service_pools_[i - 1]->stop(force_stop_);
+      io_service_pools_[i - 1]->stop(force);
+
+    started_ = false;
+  }
 
-    // For gracefully close, continue to repeat several times to dispatch and perform asynchronous operations/handlers.
-    while (!force_stop_)
+  /// Get the number of outstanding operations of all io_service_pool.
+  ///   A connection is bound with both io_pool and a work pool, so it is counted on io_pool only.
+  size_t outstanding()
+  {
+    size_t count = io_service_pools_[io_pool]->connections();
+    for (size_t i = io_service_pools_.size(); i > 0; --i)
+      count += io_service_pools_[i - 1]->pending();
+
+    return count;
+  }
+
+private:
+  /// Wait for outstanding operations to finish, return false if the deadline is passed.
+  bool drain()
+  {
+    boost::posix_time::ptime deadline = boost::posix_time::microsec_clock::universal_time() + \
+        boost::posix_time::seconds(drain_timeout_);
+
+    for (;;)
     {
-      bool idle = true;
-      for (size_t i = io_service_pools_.size(); idle && i > 0; --i)
-        idle = io_service_pools_[i - 1]->idle();
+      size_t count = outstanding();
 
-      if (idle)
-        break;
+      // Report progress of draining.
+      if (drain_handler_)
+        drain_handler_(count);
 
-      // Start all io_service_pool with non-blocked mode.
-      for (size_t i = io_service_pools_.size(); i > 0; --i)
-        io_service_pools_[i - 1]->start();
+      if (count == 0)
+        return true;
 
-      // Stop all io_service_pool with graceful mode.
-      for (size_t i = io_service_pools_.size(); i > 0; --i)
-        io_service_pools_[i - 1]->stop();
-    }
+      if (drain_timeout_ != 0 && boost::posix_time::microsec_clock::universal_time() >= deadline)
+        return false;
 
-    started_ = false;
+      boost::this_thread::sleep(boost::posix_time::milliseconds(BAS_IO_SERVICE_GROUP_DRAIN_INTERVAL));
+    }
   }
 
-private:
   /// Clear and release shared_pre of io_service_pool.
   void clear()
   {
@@ -147,6 +273,12 @@ private:
 
   /// Stop mode of the io_service_group.
   bool force_stop_;
+
+  /// The handler for reporting progress of draining.
+  drain_handler_t drain_handler_;
+
+  /// The seconds for draining outstanding operations before force stop.
+  unsigned int drain_timeout_;
 };
 
 } // namespace bas
@@ -0,0 +1,122 @@
+//
+// io_service_info.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2012 Xu Ye Jun (moore.xu@gmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BAS_IO_SERVICE_INFO_HPP
+#define BAS_IO_SERVICE_INFO_HPP
+
+#include <boost/asio.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+namespace bas {
+
+/// Service for holding the running information of an io_service object.
+///   Use boost::asio::use_service<io_service_info>(io_service) to get it.
+class io_service_info
+  : public boost::asio::detail::service_base<io_service_info>
+{
+public:
+  /// Constructor.
+  explicit io_service_info(boost::asio::io_service& io_service)
+    : boost::asio::detail::service_base<io_service_info>(io_service),
+      concurrent_(false),
+      node_(-1),
+      connections_(0),
+      pending_(0)
+  {
+  }
+
+  /// Destroy all user-defined handler objects owned by the service.
+  void shutdown_service()
+  {
+  }
+
+  /// Destroy all user-defined handler objects owned by the service, for newer asio.
+  void shutdown()
+  {
+  }
+
+  /// Get whether handlers of the io_service may be executed by more than one thread.
+  bool concurrent() const
+  {
+    return concurrent_;
+  }
+
+  /// Set whether handlers of the io_service may be executed by more than one thread.
+  ///   Must be set before any service_handler bind with the io_service.
+  void concurrent(bool value)
+  {
+    concurrent_ = value;
+  }
+
+  /// Get the NUMA node of the threads running the io_service, -1 if unknown.
+  int node() const
+  {
+    return node_;
+  }
+
+  /// Set the NUMA node of the threads running the io_service.
+  void node(int value)
+  {
+    node_ = value;
+  }
+
+  /// Get the number of service_handlers bound with the io_service.
+  std::size_t connections() const
+  {
+    return static_cast<std::size_t>(connections_);
+  }
+
+  /// Increase the number of service_handlers bound with the io_service, can be call from any thread.
+  void attach()
+  {
+    ++connections_;
+  }
+
+  /// Decrease the number of service_handlers bound with the io_service, can be call from any thread.
+  void detach()
+  {
+    --connections_;
+  }
+
+  /// Get the number of handlers posted to the io_service and not yet finished.
+  std::size_t pending() const
+  {
+    return static_cast<std::size_t>(pending_);
+  }
+
+  /// Increase the number of pending handlers when a handler is posted, can be call from any thread.
+  void enqueue()
+  {
+    ++pending_;
+  }
+
+  /// Decrease the number of pending handlers when a handler is finished, can be call from any thread.
+  void dequeue()
+  {
+    --pending_;
+  }
+
+private:
+  /// Flag to indicate handlers may be executed by more than one thread.
+  bool concurrent_;
+
+  /// The NUMA node of the threads running the io_service.
+  int node_;
+
+  /// The number of service_handlers bound with the io_service.
+  boost::detail::atomic_count connections_;
+
+  /// The number of handlers posted to the io_service and not yet finished.
+  boost::detail::atomic_count pending_;
+};
+
+} // namespace bas
+
+#endif // BAS_IO_SERVICE_INFO_HPP
@@ -12,20 +12,33 @@
 #define BAS_IO_SERVICE_POOL_HPP
 
 #include <boost/assert.hpp>
+#include <boost/atomic.hpp>
 #include <boost/thread.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/detail/mutex.hpp>
 #include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/weak_ptr.hpp>
+#include <algorithm>
 #include <vector>
 
+#include <bas/io_service_info.hpp>
+#include <bas/thread_affinity.hpp>
+
 namespace bas {
 
 #define BAS_IO_SERVICE_POOL_INIT_SIZE       4
 #define BAS_IO_SERVICE_POOL_HIGH_WATERMARK  32
 #define BAS_IO_SERVICE_POOL_THREAD_LOAD     100
 
+#define BAS_IO_SERVICE_POOL_STEAL_MIN_INTERVAL  1
+#define BAS_IO_SERVICE_POOL_STEAL_MAX_INTERVAL  2
+
+#define BAS_IO_SERVICE_POOL_SHRINK_SECONDS  0
+
 /// A pool of io_service objects.
 class io_service_pool
   : private boost::noncopyable
@@ -40,28 +53,73 @@ public:
   /// Define type reference of boost::asio::detail::mutex::scoped_lock.
   typedef boost::asio::detail::mutex::scoped_lock scoped_lock_t;
 
+  /// Define the threading model of the pool.
+  enum model_t
+  {
+    /// Each io_service is run by its own thread.
+    single_model = 0,
+
+    /// Each io_service is run by its own thread, idle threads steal handlers from other io_services.
+    ///   Handlers are serialized by strand of service_handler for keeping the order of a connection,
+    ///   only works are posted through the strand, so the model is refused for io_pool of io_service_group.
+    stealing_model,
+
+    /// One io_service is shared and run by all threads of the pool.
+    ///   Handlers are serialized by strand of service_handler for keeping the order of a connection,
+    ///   only works are posted through the strand, so the model is refused for io_pool of io_service_group.
+    shared_model
+  };
+
+  /// Define the policy of choosing an io_service for a new connection.
+  enum policy_t
+  {
+    /// Choose io_services in turn.
+    round_robin_policy = 0,
+
+    /// Choose the io_service with the least load, the load is bound connections plus pending handlers.
+    least_connections_policy,
+
+    /// Choose the io_service with less load from two random io_services.
+    power_of_two_policy
+  };
+
   /// Constructor.
   io_service_pool(size_t pool_init_size = BAS_IO_SERVICE_POOL_INIT_SIZE,
       size_t pool_high_watermark = BAS_IO_SERVICE_POOL_HIGH_WATERMARK,
       size_t pool_thread_load = BAS_IO_SERVICE_POOL_THREAD_LOAD)
     : mutex_(),
+      blocked_(false),
+      model_(single_model),
+      policy_(round_robin_policy),
+      random_seed_(0),
       io_services_(),
+      snapshot_(),
       threads_(),
+      thread_count_(0),
       work_(),
+      retired_(),
+      held_(),
+      shrink_timer_(),
+      processors_(),
       pool_init_size_(pool_init_size),
       pool_high_watermark_(pool_high_watermark),
       pool_thread_load_(pool_thread_load),
+      shrink_seconds_(BAS_IO_SERVICE_POOL_SHRINK_SECONDS),
+      shrink_load_(0),
+      low_seconds_(0),
+      shrinking_(false),
       next_io_service_(0),
-      blocked_(false),
-      idle_(true)
+      next_victim_(0)
   {
     BOOST_ASSERT(pool_init_size_ != 0);
     BOOST_ASSERT(pool_high_watermark_ >= pool_init_size_);
     BOOST_ASSERT(pool_thread_load_ != 0);
 
     // Create io_service pool.
-    for (size_t i = 0; i < pool_init_size_; ++i)
-      io_services_.push_back(io_service_ptr(new boost::asio::io_service));
+    for (size_t i = 0; i < service_size(); ++i)
+      io_services_.push_back(make_io_service());
+
+    publish();
   }
 
   /// Destruct the pool object.
@@ -71,6 +129,7 @@ public:
     stop();
 
     // Destroy io_service pool.
+    snapshot_.reset();
     for (size_t i = io_services_.size(); i > 0 ; --i)
       io_services_[i - 1].reset();
 
@@ -86,7 +145,7 @@ public:
     BOOST_ASSERT(pool_high_watermark >= pool_init_size);
     BOOST_ASSERT(pool_thread_load != 0);
 
-    if (threads_.empty())
+    if (thread_count_ == 0)
     {
       pool_init_size_ = pool_init_size;
       pool_high_watermark_ = pool_high_watermark;
@@ -96,6 +155,88 @@ public:
     return *this;
   }
 
+  /// Set parameters for shrinking the pool. Threads created by get_io_service(load) are retired one by one
+  ///   when the load stays below shrink_load * (threads - 1) for shrink_seconds.
+  ///   A retired thread exits after no connection is bound with its io_service and no thread may still bind one:
+  ///   each thread holds the snapshot it chose an io_service from until it chooses again, so a connection must be
+  ///   bound in the thread that chose its io_service.
+  ///   shrink_seconds = 0 disables shrinking, shrink_load = 0 means half of pool_thread_load.
+  ///   The pool with shared_model is never shrunk.
+  io_service_pool& set_shrink(unsigned int shrink_seconds, size_t shrink_load = 0)
+  {
+    if (thread_count_ == 0)
+    {
+      shrink_seconds_ = shrink_seconds;
+      shrink_load_ = shrink_load;
+    }
+
+    return *this;
+  }
+
+  /// Set threading model of the pool.
+  io_service_pool& set_model(model_t model)
+  {
+    if (thread_count_ == 0 && model != model_)
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(mutex_);
+
+      model_ = model;
+
+      // Recreate io_service pool for the new model.
+      io_services_.clear();
+      for (size_t i = 0; i < service_size(); ++i)
+        io_services_.push_back(make_io_service());
+
+      publish();
+    }
+
+    return *this;
+  }
+
+  /// Set policy of choosing an io_service for a new connection.
+  io_service_pool& set_policy(policy_t policy)
+  {
+    if (thread_count_ == 0)
+      policy_ = policy;
+
+    return *this;
+  }
+
+  /// Get policy of choosing an io_service for a new connection.
+  policy_t get_policy() const
+  {
+    return policy_;
+  }
+
+  /// Set processors to bind threads, thread i is bound to processors[i % processors.size()].
+  ///   An empty list means threads are not bound.
+  io_service_pool& set_affinity(const std::vector<int>& processors)
+  {
+    if (thread_count_ == 0)
+      processors_ = processors;
+
+    return *this;
+  }
+
+  /// Get the NUMA node of the threads running the given io_service, -1 if unknown.
+  int get_node(boost::asio::io_service& io_service)
+  {
+    // Look up the snapshot first, use_service() will lock the io_service.
+    snapshot_ptr snapshot = get_snapshot();
+    for (size_t i = snapshot->entries.size(); i > 0; --i)
+      if (snapshot->entries[i - 1].io_service.get() == &io_service)
+        return snapshot->entries[i - 1].info->node();
+
+    return boost::asio::use_service<io_service_info>(io_service).node();
+  }
+
+  /// Get threading model of the pool.
+  model_t get_model() const
+  {
+    return model_;
+  }
+
   /// Get the size of the pool.
   size_t size()
   {
@@ -105,19 +246,35 @@ public:
     return io_services_.size();
   }
 
+  /// Get the number of outstanding operations, the sum of bound connections and pending handlers.
+  ///   Retired io_services are included.
+  size_t outstanding()
+  {
+    return connections() + pending();
+  }
+
+  /// Get the number of connections bound with io_services of the pool, retired io_services are included.
+  size_t connections()
+  {
+    return sum(&io_service_info::connections);
+  }
+
+  /// Get the number of handlers pending on io_services of the pool, retired io_services are included.
+  size_t pending()
+  {
+    return sum(&io_service_info::pending);
+  }
+
   /// Get the load of each thread.
   size_t get_thread_load() const
   {
     return pool_thread_load_;
   }
 
-  /// Get work status of the pool.
+  /// Get work status of the pool, idle when no connection is bound and no handler is pending.
   bool idle()
   {
-    // Lock for synchronize access to data.
-    scoped_lock_t lock(mutex_);
-
-    return idle_;
+    return outstanding() == 0;
   }
 
   /// Run all io_service objects in blocked model.
@@ -129,7 +286,7 @@ public:
   /// Start all io_service objects, default with non-bocked mode.
   void start(bool blocked = false)
   {
-    if (!threads_.empty())
+    if (thread_count_ != 0)
       return;
 
     {
@@ -139,19 +296,27 @@ public:
       blocked_ = blocked;
 
       // Create additional io_service pool.
-      for (size_t i = io_services_.size(); i < pool_init_size_; ++i)
-        io_services_.push_back(io_service_ptr(new boost::asio::io_service));
+      for (size_t i = io_services_.size(); i < service_size(); ++i)
+        io_services_.push_back(make_io_service());
 
       // Release redundant io_service pool.
-      for (size_t i = io_services_.size(); i > pool_init_size_; --i)
+      for (size_t i = io_services_.size(); i > service_size(); --i)
         io_services_.pop_back();
 
-      // The pool is still idle now, set to true.
-      idle_ = true;
-
-      // Start all io_service.
-      for (size_t i = io_services_.size(); i > 0 ; --i)
-        start_one(io_services_[i - 1]);
+      // Start all io_service, the shared io_service is run by all threads.
+      if (model_ == shared_model)
+      {
+        for (size_t i = pool_init_size_; i > 0 ; --i)
+          start_one(io_services_[0]);
+      }
+      else
+      {
+        // Start in order, so threads_[i] and work_[i] are used for io_services_[i].
+        for (size_t i = 0; i < io_services_.size(); ++i)
+          start_one(io_services_[i]);
+      }
+
+      publish();
     }
 
     // If in block mode, wait for all threads to exit.
@@ -175,6 +340,17 @@ public:
         work_[i - 1].reset();
 
       work_.clear();
+
+      // Retired io_services are also allowed to finish.
+      for (size_t i = retired_.size(); i > 0 ; --i)
+        retired_[i - 1].work.reset();
+
+      // Cancel the timer for shrinking the pool.
+      if (shrinking_)
+      {
+        shrink_timer_->cancel();
+        shrinking_ = false;
+      }
     }
 
     // If in force mode, maybe some handlers cannot be dispatched.
@@ -186,75 +362,557 @@ public:
       wait();
   }
 
-  /// Get an io_service to use.
+  /// Get an io_service to use, without lock.
   boost::asio::io_service& get_io_service()
   {
-    // Lock for synchronize access to data.
-    scoped_lock_t lock(mutex_);
+    snapshot_ptr snapshot = get_snapshot();
+    hold(snapshot);
 
-    // Use a round-robin scheme to choose the next io_service to use.
-    if (next_io_service_ >= io_services_.size())
-      next_io_service_ = 0;
+    return get_io_service_i(*snapshot, -1);
+  }
+
+  /// Get the io_service of the given index, without lock.
+  boost::asio::io_service& get_io_service_at(size_t index)
+  {
+    snapshot_ptr snapshot = get_snapshot();
+    hold(snapshot);
 
-    return *io_services_[next_io_service_++];
+    return *snapshot->entries[index % snapshot->entries.size()].io_service;
   }
 
   /// Get an io_service to use. if need then create one to use.
   boost::asio::io_service& get_io_service(size_t load)
+  {
+    return get_io_service(load, -1);
+  }
+
+  /// Get an io_service running on the given NUMA node to use. if need then create one to use.
+  ///   If no io_service running on the node, any io_service will be used.
+  ///   The lock is only taken when the pool need to grow.
+  boost::asio::io_service& get_io_service(size_t load, int node)
   {
     // Calculate the required number of threads.
     size_t threads_number = load / pool_thread_load_;
 
-    // Lock for synchronize access to data.
-    scoped_lock_t lock(mutex_);
-
-    size_t service_count = io_services_.size();
-    if (!blocked_                            && \
-        !work_.empty()                       && \
-        !threads_.empty()                    && \
-        threads_number > service_count       && \
-        service_count < pool_high_watermark_)
+    snapshot_ptr snapshot = get_snapshot();
+    if (threads_number > snapshot->threads)
     {
-      // Create new io_service and start it.
-      io_service_ptr io_service(new boost::asio::io_service);
-      io_services_.push_back(io_service);
-      start_one(io_service);
-      next_io_service_ = service_count;
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(mutex_);
+
+      size_t thread_count = threads_.size();
+      if (!blocked_                            && \
+          !work_.empty()                       && \
+          thread_count != 0                    && \
+          threads_number > thread_count        && \
+          thread_count < pool_high_watermark_)
+      {
+        io_service_ptr io_service;
+        if (model_ == shared_model)
+        {
+          // Add a new thread to run the shared io_service.
+          start_one(io_services_[0]);
+        }
+        else
+        {
+          // Create new io_service and start it.
+          io_service = make_io_service();
+          io_services_.push_back(io_service);
+          start_one(io_service);
+
+          // Check load periodically for shrinking the pool.
+          start_shrink();
+        }
+
+        publish();
+
+        // Use the new io_service if it is running on the node.
+        if (io_service.get() != 0 && (node < 0 || get_node(*io_service) == node))
+        {
+          hold(snapshot_);
+          return *io_service;
+        }
+      }
+
+      snapshot = snapshot_;
     }
 
-    return get_io_service();
+    hold(snapshot);
+
+    return get_io_service_i(*snapshot, node);
   }
 
 private:
   typedef boost::shared_ptr<boost::asio::io_service> io_service_ptr;
   typedef boost::shared_ptr<boost::asio::io_service::work> work_ptr;
   typedef boost::shared_ptr<boost::thread> thread_ptr;
+  typedef boost::shared_ptr<boost::atomic<size_t> > counter_ptr;
+  typedef boost::shared_ptr<boost::asio::deadline_timer> timer_ptr;
+  typedef boost::shared_ptr<void> token_ptr;
+
+  /// The io_service and its information in the snapshot.
+  ///   The token is shared by all snapshots containing the io_service, it expires when no snapshot holds the io_service.
+  struct entry_t
+  {
+    io_service_ptr io_service;
+    io_service_info* info;
+    token_ptr token;
+  };
+
+  /// The immutable copy of io_services for choosing an io_service without lock.
+  ///   A new snapshot is published when io_services or threads of the pool changed.
+  struct snapshot_t
+  {
+    std::vector<entry_t> entries;
+    size_t threads;
+  };
+
+  typedef boost::shared_ptr<const snapshot_t> snapshot_ptr;
+
+  /// The io_service retired from the pool, waiting for bound connections to be closed.
+  struct retired_t
+  {
+    io_service_ptr io_service;
+    work_ptr work;
+    thread_ptr thread;
+    boost::weak_ptr<void> token;
+  };
+
+  /// Create an io_service for the current model.
+  io_service_ptr make_io_service()
+  {
+    io_service_ptr io_service(new boost::asio::io_service);
+
+    // Handlers maybe executed by more than one thread, tell service_handler to use strand.
+    boost::asio::use_service<io_service_info>(*io_service).concurrent(model_ != single_model);
+
+    return io_service;
+  }
+
+  /// Get the number of io_service objects for the current model.
+  size_t service_size() const
+  {
+    return (model_ == shared_model) ? 1 : pool_init_size_;
+  }
+
+  /// Get the current snapshot of the pool, can be call from any thread.
+  snapshot_ptr get_snapshot() const
+  {
+    return boost::atomic_load(&snapshot_);
+  }
+
+  /// Publish a new snapshot of the pool, caller must hold the lock.
+  void publish()
+  {
+    thread_count_ = threads_.size();
+
+    boost::shared_ptr<snapshot_t> snapshot(new snapshot_t);
+    snapshot->threads = threads_.size();
+    snapshot->entries.resize(io_services_.size());
+    for (size_t i = 0; i < io_services_.size(); ++i)
+    {
+      snapshot->entries[i].io_service = io_services_[i];
+      snapshot->entries[i].info = &boost::asio::use_service<io_service_info>(*io_services_[i]);
+
+      // Keep the token of the io_service from the last snapshot.
+      token_ptr token = find_token(io_services_[i]);
+      snapshot->entries[i].token = (token.get() != 0) ? token : token_ptr(new char(0));
+    }
+
+    boost::atomic_store(&snapshot_, snapshot_ptr(snapshot));
+  }
+
+  /// Find the token of the io_service in the current snapshot, caller must hold the lock.
+  token_ptr find_token(const io_service_ptr& io_service)
+  {
+    if (snapshot_.get() != 0)
+      for (size_t i = snapshot_->entries.size(); i > 0; --i)
+        if (snapshot_->entries[i - 1].io_service == io_service)
+          return snapshot_->entries[i - 1].token;
+
+    return token_ptr();
+  }
+
+  /// Hold the snapshot in the calling thread until it chooses again, if the pool may retire io_services.
+  ///   An io_service chosen from the snapshot can't be retired before the connection is bound with it.
+  void hold(const snapshot_ptr& snapshot)
+  {
+    if (shrink_seconds_ == 0)
+      return;
+
+    snapshot_ptr* held = held_.get();
+    if (held == 0)
+    {
+      held = new snapshot_ptr();
+      held_.reset(held);
+    }
+
+    *held = snapshot;
+  }
+
+  /// Sum a counter of io_service_info over all io_services, retired io_services are included.
+  size_t sum(size_t (io_service_info::*counter)() const)
+  {
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    size_t count = 0;
+    for (size_t i = io_services_.size(); i > 0 ; --i)
+      count += (boost::asio::use_service<io_service_info>(*io_services_[i - 1]).*counter)();
+
+    for (size_t i = retired_.size(); i > 0 ; --i)
+      count += (boost::asio::use_service<io_service_info>(*retired_[i - 1].io_service).*counter)();
+
+    return count;
+  }
+
+  /// Get the load of an io_service, the load is bound connections plus pending handlers.
+  static size_t get_load(const entry_t& entry)
+  {
+    return entry.info->connections() + entry.info->pending();
+  }
+
+  /// Check whether the io_service is running on the given NUMA node, -1 matches any node.
+  static bool on_node(const entry_t& entry, int node)
+  {
+    return (node < 0) || (entry.info->node() == node);
+  }
+
+  /// Get an io_service on the given NUMA node from the snapshot with the policy of the pool.
+  ///   If no io_service running on the node, any io_service will be used.
+  boost::asio::io_service& get_io_service_i(const snapshot_t& snapshot, int node)
+  {
+    const std::vector<entry_t>& entries = snapshot.entries;
+    if (entries.size() == 1)
+      return *entries[0].io_service;
+
+    if (node >= 0)
+    {
+      bool found = false;
+      for (size_t i = entries.size(); !found && i > 0; --i)
+        found = on_node(entries[i - 1], node);
+
+      if (!found)
+        node = -1;
+    }
+
+    switch (policy_)
+    {
+    case least_connections_policy:
+      return *entries[least_loaded(entries, node)].io_service;
+    case power_of_two_policy:
+      return *entries[two_choices(entries, node)].io_service;
+    default:
+      return *entries[round_robin(entries, node)].io_service;
+    }
+  }
+
+  /// Use a round-robin scheme to choose the next io_service on the node.
+  size_t round_robin(const std::vector<entry_t>& entries, int node)
+  {
+    size_t size = entries.size();
+    for (size_t i = size; i > 0; --i)
+    {
+      size_t index = next_io_service_.fetch_add(1, boost::memory_order_relaxed) % size;
+      if (on_node(entries[index], node))
+        return index;
+    }
+
+    return 0;
+  }
+
+  /// Choose the io_service with the least load on the node.
+  size_t least_loaded(const std::vector<entry_t>& entries, int node)
+  {
+    size_t size = entries.size();
+    size_t best = size;
+    size_t best_load = 0;
+
+    // Start from the next io_service, so io_services with the same load are used in turn.
+    size_t start = next_io_service_.fetch_add(1, boost::memory_order_relaxed) % size;
+    for (size_t i = 0; i < size; ++i)
+    {
+      size_t index = (start + i) % size;
+      if (!on_node(entries[index], node))
+        continue;
+
+      size_t load = get_load(entries[index]);
+      if (best == size || load < best_load)
+      {
+        best = index;
+        best_load = load;
+      }
+    }
+
+    return (best == size) ? 0 : best;
+  }
+
+  /// Choose the io_service with less load from two random io_services on the node.
+  size_t two_choices(const std::vector<entry_t>& entries, int node)
+  {
+    size_t first = random_on_node(entries, node);
+    size_t second = random_on_node(entries, node);
+
+    return (get_load(entries[second]) < get_load(entries[first])) ? second : first;
+  }
+
+  /// Get a random io_service on the node.
+  size_t random_on_node(const std::vector<entry_t>& entries, int node)
+  {
+    size_t size = entries.size();
+    size_t index = next_random() % size;
+
+    // Search forward for an io_service on the node.
+    for (size_t i = size; i > 0; --i, index = (index + 1) % size)
+      if (on_node(entries[index], node))
+        return index;
+
+    return 0;
+  }
+
+  /// Get the next pseudo random number, can be call from any thread.
+  ///   Scramble an atomic sequence with multiplicative hashing, so no lock is needed.
+  unsigned long next_random()
+  {
+    unsigned long value = static_cast<unsigned long>(random_seed_.fetch_add(1, boost::memory_order_relaxed) + 1) * 2654435761UL;
+
+    return (value >> 16) ^ value;
+  }
 
   /// Wait for all threads in the pool to exit.
   void wait()
   {
-    if (threads_.empty())
+    std::vector<thread_ptr> threads;
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(mutex_);
+
+      threads = threads_;
+    }
+
+    if (threads.empty())
       return;
 
     // Wait for all threads in the pool to exit.
-    for (size_t i = threads_.size(); i > 0 ; --i)
-      threads_[i - 1]->join();
+    for (size_t i = threads.size(); i > 0 ; --i)
+      threads[i - 1]->join();
+
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(mutex_);
 
-    // Destroy all threads.
-    threads_.clear();
+      // Destroy all threads.
+      threads_.clear();
+
+      publish();
+    }
+
+    // Wait for all retired threads to exit.
+    for (size_t i = retired_.size(); i > 0 ; --i)
+      retired_[i - 1].thread->join();
+
+    retired_.clear();
+    shrink_timer_.reset();
   }
 
   /// Run an io_service.
-  void run_service(io_service_ptr io_service)
+  void run_service(io_service_ptr io_service, int processor)
+  {
+    // Bind the thread to the processor.
+    thread_affinity::bind(processor);
+
+    // Run the io_service.
+    io_service->run();
+  }
+
+  /// Run an io_service, steal handlers from other io_services when it is idle.
+  void run_stealing(io_service_ptr io_service, int processor)
   {
-    // Run the io_service and check executed handler number.
-    if (io_service->run() != 0)
+    // Bind the thread to the processor.
+    thread_affinity::bind(processor);
+
+    // Timer for waking up the thread to steal again.
+    boost::asio::deadline_timer timer(*io_service);
+    counter_ptr armed(new boost::atomic<size_t>(0));
+    long interval = BAS_IO_SERVICE_POOL_STEAL_MIN_INTERVAL;
+    boost::system::error_code ec;
+
+    for (;;)
     {
-      // Lock for synchronize access to data.
-      scoped_lock_t lock(mutex_);
+      // Execute ready handlers of its own io_service first, then try to steal one.
+      if (io_service->poll(ec) != 0)
+        continue;
+
+      if (steal_one(io_service))
+      {
+        interval = BAS_IO_SERVICE_POOL_STEAL_MIN_INTERVAL;
+        continue;
+      }
+
+      if (*armed == 0)
+      {
+        // Nothing to do and the io_service is stopping, exit.
+        if (stopping(io_service))
+          break;
+
+        // Wake up later for stealing, the interval is doubled while nothing can be stolen.
+        ++(*armed);
+        timer.expires_from_now(boost::posix_time::milliseconds(interval));
+        timer.async_wait(boost::bind(&io_service_pool::handle_steal_timer,
+                                     armed));
+        interval = (std::min)(interval * 2, static_cast<long>(BAS_IO_SERVICE_POOL_STEAL_MAX_INTERVAL));
+      }
+
+      // Wait for a handler of its own io_service or the timer, a ready handler of a busy io_service
+      //   waits at most BAS_IO_SERVICE_POOL_STEAL_MAX_INTERVAL milliseconds for an idle thread.
+      if (io_service->run_one(ec) == 0)
+        break;
+    }
+  }
+
+  /// Handle the timer of stealing thread.
+  static void handle_steal_timer(counter_ptr armed)
+  {
+    --(*armed);
+  }
+
+  /// Steal and execute one ready handler from other io_services, victims are read from the snapshot without lock.
+  bool steal_one(io_service_ptr& self)
+  {
+    snapshot_ptr snapshot = get_snapshot();
+    const std::vector<entry_t>& entries = snapshot->entries;
+
+    for (size_t i = entries.size(); i > 0; --i)
+    {
+      const io_service_ptr& victim = entries[next_victim_.fetch_add(1, boost::memory_order_relaxed) % entries.size()].io_service;
 
-      // Some handlers has been executed, set to false.
-      idle_ = false;
+      boost::system::error_code ec;
+      if (victim != self && victim->poll_one(ec) != 0)
+        return true;
+    }
+
+    return false;
+  }
+
+  /// Check the io_service is stopping, its work object has been destroyed.
+  bool stopping(io_service_ptr& io_service)
+  {
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    for (size_t i = retired_.size(); i > 0 ; --i)
+      if (retired_[i - 1].io_service == io_service)
+        return retired_[i - 1].work.get() == 0;
+
+    return work_.empty();
+  }
+
+  /// Start the timer for shrinking the pool if need, caller must hold the lock.
+  ///   The timer runs only while the pool has more threads than pool_init_size_.
+  void start_shrink()
+  {
+    if (shrink_seconds_ == 0 || shrinking_)
+      return;
+
+    if (shrink_timer_.get() == 0)
+      shrink_timer_.reset(new boost::asio::deadline_timer(*io_services_[0]));
+
+    shrinking_ = true;
+    low_seconds_ = 0;
+    arm_shrink();
+  }
+
+  /// Check load again after one second, caller must hold the lock.
+  void arm_shrink()
+  {
+    shrink_timer_->expires_from_now(boost::posix_time::seconds(1));
+    shrink_timer_->async_wait(boost::bind(&io_service_pool::handle_shrink,
+                                          this,
+                                          boost::asio::placeholders::error));
+  }
+
+  /// Handle timer for shrinking the pool.
+  void handle_shrink(const boost::system::error_code& ec)
+  {
+    // The timer has been cancelled, do nothing.
+    if (ec == boost::asio::error::operation_aborted)
+      return;
+
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    // The pool is stopping, do nothing.
+    if (!shrinking_)
+      return;
+
+    // Release retired io_services that have no connection.
+    reap_retired();
+
+    // Calculate the load of the pool.
+    size_t load = 0;
+    for (size_t i = io_services_.size(); i > 0 ; --i)
+      load += boost::asio::use_service<io_service_info>(*io_services_[i - 1]).connections();
+
+    size_t thread_count = threads_.size();
+    size_t shrink_load = (shrink_load_ != 0) ? shrink_load_ : pool_thread_load_ / 2;
+
+    // Retire the last io_service if the load stays low for enough seconds.
+    if (thread_count > pool_init_size_ && load < shrink_load * (thread_count - 1))
+    {
+      if (++low_seconds_ >= shrink_seconds_)
+      {
+        retire_one();
+        low_seconds_ = 0;
+      }
+    }
+    else
+      low_seconds_ = 0;
+
+    // Stop checking after the pool is back to the initial size and all retired threads exited.
+    if (threads_.size() <= pool_init_size_ && retired_.empty())
+    {
+      shrinking_ = false;
+      return;
+    }
+
+    arm_shrink();
+  }
+
+  /// Retire the last io_service, caller must hold the lock.
+  ///   No new connection will use it, and its thread will exit after all bound connections closed.
+  void retire_one()
+  {
+    retired_t retired;
+    retired.io_service = io_services_.back();
+    retired.work = work_.back();
+    retired.thread = threads_.back();
+    retired.token = find_token(retired.io_service);
+
+    retired_.push_back(retired);
+
+    io_services_.pop_back();
+    work_.pop_back();
+    threads_.pop_back();
+
+    publish();
+  }
+
+  /// Release retired io_services without connection, caller must hold the lock.
+  void reap_retired()
+  {
+    for (size_t i = retired_.size(); i > 0 ; --i)
+    {
+      retired_t& retired = retired_[i - 1];
+
+      // Allow the thread to exit after all handlers finished. The io_service can't be chosen any more
+      //   after no snapshot holds it, then no connection will be bound with it.
+      if (retired.token.expired() &&
+          boost::asio::use_service<io_service_info>(*retired.io_service).connections() == 0)
+        retired.work.reset();
+
+      // Remove the retired io_service after its thread exited.
+      if (retired.work.get() == 0 && retired.thread->timed_join(boost::posix_time::seconds(0)))
+        retired_.erase(retired_.begin() + (i - 1));
     }
   }
 
@@ -268,10 +926,31 @@ private:
     //   exit until work was explicitly destroyed.
     work_.push_back(work_ptr(new boost::asio::io_service::work(*io_service)));
 
+    // Choose the processor for the new thread, and record its NUMA node on the io_service.
+    int processor = -1;
+    if (!processors_.empty())
+    {
+      processor = processors_[threads_.size() % processors_.size()];
+
+      io_service_info& info = boost::asio::use_service<io_service_info>(*io_service);
+      int node = thread_affinity::node_of(processor);
+      if (model_ == shared_model && threads_.size() != 0 && info.node() != node)
+        node = -1;
+
+      info.node(node);
+    }
+
     // Create a thread to run the io_service.
-    threads_.push_back(thread_ptr(new boost::thread(boost::bind(&io_service_pool::run_service,
-                                                                this,
-                                                                io_service))));
+    if (model_ == stealing_model)
+      threads_.push_back(thread_ptr(new boost::thread(boost::bind(&io_service_pool::run_stealing,
+                                                                  this,
+                                                                  io_service,
+                                                                  processor))));
+    else
+      threads_.push_back(thread_ptr(new boost::thread(boost::bind(&io_service_pool::run_service,
+                                                                  this,
+                                                                  io_service,
+                                                                  processor))));
   }
 
   /// Force stop all io_service objects in the pool.
@@ -289,18 +968,42 @@ private:
   /// Flag to indicate start mode.
   bool blocked_;
 
-  /// Flag to indicate work status.
-  bool idle_;
+  /// Threading model of the pool.
+  model_t model_;
+
+  /// Policy of choosing an io_service for a new connection.
+  policy_t policy_;
+
+  /// The sequence for choosing random io_services.
+  boost::atomic<size_t> random_seed_;
 
   /// The pool of io_services.
   std::vector<io_service_ptr> io_services_;
 
+  /// The snapshot of io_services_, replaced as a whole and read without lock.
+  snapshot_ptr snapshot_;
+
   /// The pool of threads for running individual io_service.
   std::vector<thread_ptr> threads_;
 
+  /// The number of threads, updated with the snapshot and read without lock.
+  boost::atomic<size_t> thread_count_;
+
   /// The work that keeps the io_services running.
   std::vector<work_ptr> work_;
 
+  /// The io_services retired by shrinking.
+  std::vector<retired_t> retired_;
+
+  /// The snapshot held by each thread since it chose an io_service.
+  boost::thread_specific_ptr<snapshot_ptr> held_;
+
+  /// Timer for shrinking the pool.
+  timer_ptr shrink_timer_;
+
+  /// The processors to bind threads.
+  std::vector<int> processors_;
+
   /// Initialize size of the pool.
   size_t pool_init_size_;
 
@@ -310,8 +1013,23 @@ private:
   /// The carrying load of each thread.
   size_t pool_thread_load_;
 
+  /// The seconds of low load before shrinking the pool.
+  unsigned int shrink_seconds_;
+
+  /// The load of each thread below which the pool is shrunk.
+  size_t shrink_load_;
+
+  /// The seconds the load has stayed low.
+  unsigned int low_seconds_;
+
+  /// Flag to indicate the timer for shrinking the pool is running.
+  bool shrinking_;
+
   /// The next io_service to use for a connection.
-  size_t next_io_service_;
+  boost::atomic<size_t> next_io_service_;
+
+  /// The next io_service to steal handlers from.
+  boost::atomic<size_t> next_victim_;
 };
 
 } // namespace bas
@@ -16,6 +16,19 @@
 #include <boost/bind.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/version.hpp>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#include <cstddef>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <bas/io_service_group.hpp>
 #include <bas/service_handler.hpp>
@@ -23,8 +36,10 @@
 
 namespace bas {
 
-#define BAS_ACCEPT_QUEUE_LENGTH   250
-#define BAS_ACCEPT_DELAY_SECONDS  1
+#define BAS_ACCEPT_QUEUE_LENGTH        250
+#define BAS_ACCEPT_DELAY_MILLISECONDS  10
+#define BAS_ACCEPT_DELAY_SECONDS       1
+#define BAS_ACCEPT_RESERVE_SIZE        4
 
 /// The top-level class of the server.
 template<typename Work_Handler, typename Work_Allocator, typename Socket_Service = boost::asio::ip::tcp::socket>
@@ -35,19 +50,37 @@ public:
   /// Define type reference of std::size_t.
   typedef std::size_t size_type;
 
-  /// Define type reference of boost::asio::ip::tcp::endpoint.
-  typedef boost::asio::ip::tcp::endpoint endpoint_t;
-
   /// The type of the service_handler.
   typedef service_handler<Work_Handler, Socket_Service> service_handler_t;
   typedef boost::shared_ptr<service_handler_t> service_handler_ptr;
 
+  /// The protocol of the socket. The default tcp socket only takes TCP endpoints, use
+  ///   boost::asio::generic::stream_protocol::socket as Socket_Service to listen on both TCP and Unix domain sockets,
+  ///   the endpoints are converted with endpoint_t(boost::asio::local::stream_protocol::endpoint(path)).
+  typedef typename service_handler_t::protocol_t protocol_t;
+
+  /// The type of the endpoint of the protocol.
+  typedef typename service_handler_t::endpoint_t endpoint_t;
+
   /// The type of the service_handler_pool.
   typedef service_handler_pool<Work_Handler, Work_Allocator, Socket_Service> service_handler_pool_t;
   typedef boost::shared_ptr<service_handler_pool_t> service_handler_pool_ptr;
 
   typedef boost::shared_ptr<io_service_group> io_service_group_ptr;
 
+  /// The ways to handle new connections when the pool is exhausted.
+  enum admission_t
+  {
+    /// Stop accepting until a handler is put back, new connections wait in the backlog.
+    admission_delay = 0,
+
+    /// Accept new connections and reset them at once.
+    admission_reset,
+
+    /// Accept new connections, send the busy message and close them.
+    admission_busy
+  };
+
   /// Construct server object with internal io_service_group..
   server(service_handler_pool_t* service_handler_pool,
       endpoint_t& local_endpoint,
@@ -57,12 +90,16 @@ public:
       size_t work_pool_thread_load = BAS_IO_SERVICE_POOL_THREAD_LOAD,
       size_t accept_queue_length = BAS_ACCEPT_QUEUE_LENGTH)
     : service_handler_pool_(service_handler_pool),
-      endpoint_(local_endpoint),
-      service_group_(new io_service_group(2)),
-      accept_queue_length_(accept_queue_length),
+      service_group_(new io_service_group(work_handler_traits<Work_Handler>::handles_priority::value ?
+          io_service_group::priority_pool + 1 : io_service_group::work_pool + 1)),
       acceptor_service_pool_(1),
-      acceptor_(acceptor_service_pool_.get_io_service()),
-      timer_(acceptor_.get_io_service()),
+      listeners_(),
+      admission_(admission_delay),
+      busy_message_(),
+      endpoints_(1, local_endpoint),
+      accept_queue_length_(accept_queue_length),
+      priority_(io_service_group::normal_priority),
+      reuse_port_(false),
       started_(false),
       block_(false),
       has_service_group_(true)
@@ -83,12 +120,15 @@ public:
       io_service_group_ptr& service_group,
       size_t accept_queue_length = BAS_ACCEPT_QUEUE_LENGTH)
     : service_handler_pool_(service_handler_pool),
-      endpoint_(local_endpoint),
       service_group_(service_group),
-      accept_queue_length_(accept_queue_length),
       acceptor_service_pool_(1),
-      acceptor_(acceptor_service_pool_.get_io_service()),
-      timer_(acceptor_.get_io_service()),
+      listeners_(),
+      admission_(admission_delay),
+      busy_message_(),
+      endpoints_(1, local_endpoint),
+      accept_queue_length_(accept_queue_length),
+      priority_(io_service_group::normal_priority),
+      reuse_port_(false),
       started_(false),
       block_(false),
       has_service_group_(false)
@@ -107,6 +147,12 @@ public:
     // Stop server.
     stop();
 
+    // Handlers put back later must not wake up the server, wait for the wake-ups in progress.
+    service_handler_pool_->set_release_callback(typename service_handler_pool_t::release_callback_t());
+
+    // Destroy acceptors before the io_services running them.
+    listeners_.clear();
+
     // Destroy instance of io_service_group.
     service_group_.reset();
 
@@ -126,6 +172,65 @@ public:
     return *this;
   }
 
+  /// Set the default priority of the works of connections accepted by the server,
+  ///   a work handler defining get_priority chooses the priority of each connection.
+  ///   Works of high priority are executed by the priority_pool of io_service_group. The internal io_service_group
+  ///   gets a priority_pool with one thread when it is needed, an external one without priority_pool falls back to work_pool.
+  server& set_priority(io_service_group::priority_t priority)
+  {
+    if (!started_)
+    {
+      priority_ = priority;
+
+      if (priority == io_service_group::high_priority && has_service_group_)
+        service_group_->extend(io_service_group::priority_pool + 1);
+    }
+
+    return *this;
+  }
+
+  /// Set the way to handle new connections when the pool is exhausted.
+  ///   Connections are rejected with a few reserved sockets, the busy message is sent before closing in admission_busy.
+  server& set_admission(admission_t admission, const std::string& busy_message = std::string())
+  {
+    if (!started_)
+    {
+      admission_ = admission;
+      busy_message_ = busy_message;
+    }
+
+    return *this;
+  }
+
+  /// Add an endpoint to listen on, all endpoints share the pool and io_service_group of the server.
+  ///   An IPv6 endpoint only accepts IPv6 connections if the server has several endpoints.
+  ///   A stale file of a Unix domain socket is removed before bind if no one is listening on it,
+  ///   and the file is removed when the server stops.
+  server& add_endpoint(const endpoint_t& local_endpoint)
+  {
+    if (!started_)
+      endpoints_.push_back(local_endpoint);
+
+    return *this;
+  }
+
+  /// Set to accept with one SO_REUSEPORT acceptor in each io_service of io_pool instead of accept_service_pool.
+  ///   The kernel balances new connections among the acceptors, and each connection stays in the io_service accepted it.
+  ///   The accept queue length is shared by the acceptors. When the pool is exhausted, a connection balanced to
+  ///   an acceptor without handler is delayed or rejected, even if other acceptors have handlers waiting.
+  ///   Ignored if SO_REUSEPORT is not supported, Unix domain sockets have only one acceptor.
+  ///   Refused when the server starts if io_pool does not use single_model, the state of each acceptor
+  ///   is only accessed in the thread running its io_service.
+  server& set_reuse_port(bool reuse_port)
+  {
+#if defined(SO_REUSEPORT)
+    if (!started_)
+      reuse_port_ = reuse_port;
+#endif
+
+    return *this;
+  }
+
   /// Set io_service_group to use.
   server& set(io_service_group_ptr& service_group)
   {
@@ -140,12 +245,14 @@ public:
   }
 
   /// Start server with non-blocked model.
+  ///   Throws boost::system::system_error if an endpoint can't be listened on, the server is not started then.
   void start()
   {
     start(false);
   }
 
   /// Run server with blocked model.
+  ///   Throws boost::system::system_error if an endpoint can't be listened on, the server is not started then.
   void run()
   {
     start(true);
@@ -159,9 +266,18 @@ public:
         !has_service_group_ && !service_group_->started())
       return;
 
-    // Close the acceptor in the same thread.
-    acceptor_.get_io_service().dispatch(boost::bind(&boost::asio::ip::tcp::acceptor::close,
-        &acceptor_));
+    // Close the acceptors in their io_service threads, and wait until all are closed before stopping the io_services.
+    close_waiter waiter(listeners_.size());
+    for (size_t i = 0; i < listeners_.size(); ++i)
+      listeners_[i]->acceptor.get_io_service().dispatch(boost::bind(&server::close_listener,
+          this,
+          listeners_[i],
+          &waiter));
+
+    waiter.wait();
+
+    // Stop maintenance of the pool before its io_service.
+    service_handler_pool_->stop_maintenance();
 
     // Stop accept_service_pool.
     acceptor_service_pool_.stop();
@@ -177,6 +293,108 @@ public:
   }
 
 private:
+  /// The type of the acceptors.
+  typedef boost::asio::basic_socket_acceptor<protocol_t> acceptor_t;
+
+  /// The type of the sockets for rejecting connections.
+  typedef boost::asio::basic_stream_socket<protocol_t> reject_socket_t;
+  typedef boost::shared_ptr<reject_socket_t> reject_socket_ptr;
+
+#if defined(SO_REUSEPORT)
+  /// Socket option to allow multiple sockets bound to the same address and port.
+  typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_t;
+#endif
+
+  /// An acceptor and the state of its accepts, only accessed in the io_service thread of the acceptor.
+  struct listener
+    : private boost::noncopyable
+  {
+    /// Constructor.
+    listener(boost::asio::io_service& io_service, const endpoint_t& local_endpoint)
+      : endpoint(local_endpoint),
+        acceptor(io_service),
+        timer(io_service),
+        reserve(),
+        stalled(0),
+        retries(0),
+        seed(static_cast<unsigned long>(std::time(0)) ^ static_cast<unsigned long>(reinterpret_cast<std::size_t>(this))),
+        retrying(false),
+        rejecting(false)
+    {
+    }
+
+    /// The endpoint to listen on.
+    endpoint_t endpoint;
+
+    /// The acceptor used to listen for incoming connections.
+    acceptor_t acceptor;
+
+    /// The timer for repeat accept delay.
+    boost::asio::deadline_timer timer;
+
+    /// The reserved sockets for rejecting connections.
+    std::vector<reject_socket_ptr> reserve;
+
+    /// The number of accepts suspended for no handler.
+    size_t stalled;
+
+    /// The number of retries since the last handler is got.
+    size_t retries;
+
+    /// The seed of retry jitter.
+    unsigned long seed;
+
+    /// Flag to indicate whether the retry timer is waiting.
+    bool retrying;
+
+    /// Flag to indicate whether an accept for rejecting is pending.
+    bool rejecting;
+  };
+
+  typedef boost::shared_ptr<listener> listener_ptr;
+
+  /// Wait for the acceptors closed in their io_service threads.
+  struct close_waiter
+    : private boost::noncopyable
+  {
+    /// Constructor.
+    explicit close_waiter(size_t count)
+      : mutex(),
+        condition(),
+        remaining(count)
+    {
+    }
+
+    /// An acceptor has been closed.
+    void done()
+    {
+      // Lock for synchronize access to data.
+      boost::mutex::scoped_lock lock(mutex);
+
+      if (--remaining == 0)
+        condition.notify_all();
+    }
+
+    /// Wait until all acceptors have been closed.
+    void wait()
+    {
+      // Lock for synchronize access to data.
+      boost::mutex::scoped_lock lock(mutex);
+
+      while (remaining != 0)
+        condition.wait(lock);
+    }
+
+    /// Mutex for synchronize access to data.
+    boost::mutex mutex;
+
+    /// Condition to wake up the waiter.
+    boost::condition condition;
+
+    /// The number of acceptors not yet closed.
+    size_t remaining;
+  };
+
   /// Start server with given mode.
   void start(bool block)
   {
@@ -185,24 +403,49 @@ private:
         !has_service_group_ && !service_group_->started())
       return;
 
-    // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
-    acceptor_.open(endpoint_.protocol());
-    acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    // Start internal io_service_group with non-blocked mode, io_services of io_pool are created when it starts.
+    if (has_service_group_)
+      service_group_->start();
 
-    boost::system::error_code e;
-    acceptor_.bind(endpoint_, e);
-    if (e)
-      return;
+    // The state of SO_REUSEPORT acceptors is not synchronized, their io_services must be run by one thread each.
+    if (reuse_port_ && service_group_->get(io_service_group::io_pool).get_model() != io_service_pool::single_model)
+      reuse_port_ = false;
 
-    acceptor_.listen();
-  
-    // Accept new connections.
-    for (size_t i = 0; i < accept_queue_length_; ++i)
-      accept_one();
+    // Open the acceptors of all endpoints.
+    listeners_.clear();
+    boost::system::error_code ec;
+    for (size_t i = 0; i < endpoints_.size() && !ec; ++i)
+      ec = open(endpoints_[i]);
 
-    // Start internal io_service_group with non-blocked mode.
-    if (has_service_group_)
-      service_group_->start();
+    if (ec)
+    {
+      // Remove the files of Unix domain sockets bound before the failure.
+      for (size_t i = 0; i < listeners_.size(); ++i)
+        remove_local(*listeners_[i]);
+
+      listeners_.clear();
+
+      if (has_service_group_)
+        service_group_->stop();
+
+      throw boost::system::system_error(ec);
+    }
+
+    size_t count = listeners_.size();
+
+    // Resume suspended accepts at once when a handler is put back.
+    service_handler_pool_->set_release_callback(boost::bind(&server::handle_release,
+        this,
+        listeners_));
+
+    // Accept new connections, the queue length is shared by the acceptors.
+    for (size_t i = 0; i < count; ++i)
+      for (size_t j = 0; j < (accept_queue_length_ + count - 1) / count; ++j)
+        accept_one(listeners_[i]);
+
+    // Maintain the pool in accept_service_pool, ahead of the load of accepting,
+    //   creating handlers there never delays the works of work_pool.
+    service_handler_pool_->start_maintenance(acceptor_service_pool_.get_io_service());
 
     block_ = block;
 
@@ -210,7 +453,7 @@ private:
     {
       started_ = true;
 
-      // Start accept_service_pool with blocked mode.
+      // Start accept_service_pool with blocked mode, it only maintains the pool with SO_REUSEPORT.
       acceptor_service_pool_.run();
 
       // Stop internal io_service_group.
@@ -221,57 +464,217 @@ private:
     }
     else
     {
-      // Start accept_service_pool with non-blocked mode.
+      // Start accept_service_pool with non-blocked mode, it only maintains the pool with SO_REUSEPORT.
       acceptor_service_pool_.start();
 
       started_ = true;
     }
   }
 
+  /// Open the acceptors of the endpoint, one in accept_service_pool, or one in each io_service of io_pool with SO_REUSEPORT.
+  boost::system::error_code open(endpoint_t endpoint)
+  {
+    io_service_pool& io_pool = service_group_->get(io_service_group::io_pool);
+    size_t count = (reuse_port_ && !is_local(endpoint)) ? io_pool.size() : 1;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      listener_ptr l(new listener(reuse_port_ ? io_pool.get_io_service_at(listeners_.size()) :
+          acceptor_service_pool_.get_io_service(), endpoint));
+
+      boost::system::error_code ec = open(*l);
+      if (ec)
+        return ec;
+
+      // Other acceptors are bound to the same port if the port is chosen by the system.
+      if (i == 0)
+        endpoint = l->acceptor.local_endpoint();
+
+      listeners_.push_back(l);
+    }
+
+    return boost::system::error_code();
+  }
+
+  /// Open the acceptor and listen on its endpoint, reserve sockets for rejecting.
+  boost::system::error_code open(listener& l)
+  {
+    boost::system::error_code ec;
+    l.acceptor.open(l.endpoint.protocol(), ec);
+    if (ec)
+      return ec;
+
+    if (!is_local(l.endpoint))
+    {
+      // Set the option to reuse the address (i.e. SO_REUSEADDR).
+      l.acceptor.set_option(boost::asio::socket_base::reuse_address(true), ec);
+
+      // Leave IPv4 connections to other endpoints.
+      if (!ec && endpoints_.size() > 1 && l.endpoint.protocol().family() == BOOST_ASIO_OS_DEF(AF_INET6))
+        l.acceptor.set_option(boost::asio::ip::v6_only(true), ec);
+
+#if defined(SO_REUSEPORT)
+      if (!ec && reuse_port_)
+        l.acceptor.set_option(reuse_port_t(true), ec);
+#endif
+
+      if (ec)
+        return ec;
+    }
+    else
+      remove_stale(l);
+
+    l.acceptor.bind(l.endpoint, ec);
+    if (ec)
+      return ec;
+
+    l.acceptor.listen(boost::asio::socket_base::max_connections, ec);
+    if (ec)
+    {
+      remove_local(l);
+      return ec;
+    }
+
+    if (admission_ != admission_delay)
+      for (size_t i = 0; i < BAS_ACCEPT_RESERVE_SIZE; ++i)
+        l.reserve.push_back(reject_socket_ptr(new reject_socket_t(l.acceptor.get_io_service())));
+
+    return ec;
+  }
+
+  /// Get the file path of a Unix domain socket, empty for other endpoints and abstract sockets.
+  static std::string local_path(const endpoint_t& endpoint)
+  {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    if (!is_local(endpoint))
+      return std::string();
+
+    const ::sockaddr_un* address = reinterpret_cast<const ::sockaddr_un*>(endpoint.data());
+    std::size_t offset = offsetof(::sockaddr_un, sun_path);
+    if (endpoint.size() <= offset || address->sun_path[0] == 0)
+      return std::string();
+
+    std::string path(address->sun_path, endpoint.size() - offset);
+    return path.substr(0, path.find('\0'));
+#else
+    return std::string();
+#endif
+  }
+
+  /// Remove the file of a Unix domain socket left by a dead process, a socket still listened on is kept.
+  static void remove_stale(listener& l)
+  {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    std::string path = local_path(l.endpoint);
+    struct ::stat status;
+    if (path.empty() || ::lstat(path.c_str(), &status) != 0 || !S_ISSOCK(status.st_mode))
+      return;
+
+    reject_socket_t probe(l.acceptor.get_io_service());
+    boost::system::error_code ec;
+    probe.connect(l.endpoint, ec);
+    if (ec == boost::asio::error::connection_refused)
+      ::unlink(path.c_str());
+#endif
+  }
+
+  /// Remove the file of a Unix domain socket bound by the acceptor.
+  static void remove_local(listener& l)
+  {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    std::string path = local_path(l.endpoint);
+    if (!path.empty())
+      ::unlink(path.c_str());
+#endif
+  }
+
+  /// Check whether the endpoint is a Unix domain socket.
+  static bool is_local(const endpoint_t& endpoint)
+  {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    return endpoint.protocol().family() == AF_UNIX;
+#else
+    return false;
+#endif
+  }
+
+  /// Close the acceptor and stop retrying in io_service thread, then wake up the waiter.
+  void close_listener(listener_ptr l, close_waiter* waiter)
+  {
+    boost::system::error_code ignored_ec;
+    l->acceptor.close(ignored_ec);
+    remove_local(*l);
+
+    l->stalled = 0;
+    if (l->retrying)
+    {
+      l->retrying = false;
+      l->timer.cancel(ignored_ec);
+    }
+
+    waiter->done();
+  }
+
   /// Start an asynchronous accept, can be call from any thread.
-  void accept_one()
+  void accept_one(listener_ptr l)
   {
-    acceptor_.get_io_service().dispatch(boost::bind(&server::accept_one_i,
-        this));
+    l->acceptor.get_io_service().dispatch(boost::bind(&server::accept_one_i,
+        this,
+        l));
+  }
+
+  /// Get new handler for accept, the work_service is chosen on the NUMA node of the io_service if threads are bound.
+  ///   Non-blocking work handlers run in io_service thread, the work_pool is skipped.
+  ///   With SO_REUSEPORT the io_service of the acceptor is used, so the connection stays in the thread accepted it.
+  service_handler_ptr get_service_handler(listener& l)
+  {
+    io_service_pool& io_pool = service_group_->get(io_service_group::io_pool);
+    boost::asio::io_service& io_service = reuse_port_ ? l.acceptor.get_io_service() : io_pool.get_io_service();
+    return service_handler_pool_->get_service_handler(io_service,
+        work_handler_traits<Work_Handler>::non_blocking::value ? io_service :
+        service_group_->get_lane(priority_).get_io_service(service_handler_pool_->get_load(),
+            io_pool.get_node(io_service)));
   }
 
   /// Start an asynchronous accept in io_service thread.
-  void accept_one_i()
+  void accept_one_i(listener_ptr l)
   {
-    // Get new handler for accept.
-    service_handler_ptr handler = service_handler_pool_->get_service_handler(service_group_->get(io_service_group::io_pool).get_io_service(),
-            service_group_->get(io_service_group::work_pool).get_io_service(service_handler_pool_->get_load()));
+    service_handler_ptr handler = get_service_handler(*l);
 
-    // Wait for some seconds to accept next connection if exceed max connection number.
+    // Suspend the accept until a handler is put back if exceed max connection number.
     if (handler.get() == 0)
     {
-      timer_.expires_from_now(boost::posix_time::seconds(BAS_ACCEPT_DELAY_SECONDS));
-      timer_.async_wait(boost::bind(&server::handle_timeout,
-          this,
-          boost::asio::placeholders::error));
-      
+      stall(l);
       return;
     }
 
+    // Handlers are available again, retry without delay next time.
+    l->retries = 0;
+
     // Use new handler to accept.
-    acceptor_.async_accept(handler->socket().lowest_layer(),
+    l->acceptor.async_accept(handler->socket().lowest_layer(),
         boost::bind(&server::handle_accept,
             this,
             boost::asio::placeholders::error,
-            handler));
+            handler,
+            l));
   }
 
   /// Handle completion of an asynchronous accept operation.
   void handle_accept(const boost::system::error_code& e,
-      service_handler_ptr handler)
+      service_handler_ptr handler,
+      listener_ptr l)
   {
     if (!e)
     {
+      // Move works of the connection to the lane of its own priority.
+      set_lane(*handler, typename work_handler_traits<Work_Handler>::handles_priority());
+
       // Start the first operation of the current handler.
       handler->start();
 
       // Accept new connection in io_service thread.
-      accept_one_i();
+      accept_one_i(l);
     }
     else
     {
@@ -285,15 +688,263 @@ private:
     }
   }
 
+  /// Choose the work_service of an accepted connection by the priority from its work handler.
+  void set_lane(service_handler_t& handler, boost::true_type)
+  {
+    if (work_handler_traits<Work_Handler>::non_blocking::value)
+      return;
+
+    io_service_pool& lane = service_group_->get_lane(handler.work_handler_->get_priority(handler));
+    if (&lane == &service_group_->get_lane(priority_))
+      return;
+
+    handler.rebind_work(lane.get_io_service(service_handler_pool_->get_load(),
+        service_group_->get(io_service_group::io_pool).get_node(handler.io_service())));
+  }
+
+  /// The work handler has no get_priority function, the priority of the server is used.
+  void set_lane(service_handler_t& /*handler*/, boost::false_type)
+  {
+  }
+
+  /// Suspend an accept in io_service thread.
+  void stall(listener_ptr l)
+  {
+    ++l->stalled;
+
+    // Retry with exponential backoff in case of the wake up is missed.
+    arm_retry(l);
+
+    // Reject new connections quickly while accepts are suspended.
+    if (admission_ != admission_delay && !l->rejecting)
+      reject_one(l);
+  }
+
+  /// Start the retry timer if it is not waiting.
+  void arm_retry(listener_ptr l)
+  {
+    if (l->retrying)
+      return;
+
+    l->retrying = true;
+    l->timer.expires_from_now(boost::posix_time::milliseconds(retry_delay(*l)));
+    l->timer.async_wait(boost::bind(&server::handle_timeout,
+        this,
+        boost::asio::placeholders::error,
+        l));
+  }
+
+  /// Get the delay of the next retry in milliseconds, with random jitter in the later half.
+  static long retry_delay(listener& l)
+  {
+    long limit = BAS_ACCEPT_DELAY_SECONDS * 1000L;
+    long delay = BAS_ACCEPT_DELAY_MILLISECONDS;
+    for (size_t i = 0; i < l.retries && delay < limit; ++i)
+      delay *= 2;
+
+    if (delay > limit)
+      delay = limit;
+
+    ++l.retries;
+
+    // Linear congruential generator, only used in io_service thread.
+    l.seed = l.seed * 1103515245UL + 12345UL;
+    return delay / 2 + static_cast<long>((l.seed >> 16) % static_cast<unsigned long>(delay / 2 + 1));
+  }
+
+  /// Whether the pending accept for rejecting will resume suspended accepts, by handing its connection over.
+  ///   Otherwise the accepts resumed are queued after it, and the next connection is rejected.
+  static bool hand_over_pending(const listener& l)
+  {
+#if BOOST_VERSION >= 106600
+    return l.rejecting;
+#else
+    return false;
+#endif
+  }
+
+  /// Resume all suspended accepts in io_service thread.
+  void resume(listener_ptr l)
+  {
+    size_t stalled = l->stalled;
+    l->stalled = 0;
+
+    for (size_t i = 0; i < stalled; ++i)
+      accept_one_i(l);
+  }
+
   /// Handle timeout of wait for repeat accept.
-  void handle_timeout(const boost::system::error_code& e)
+  void handle_timeout(const boost::system::error_code& e,
+      listener_ptr l)
   {
     // The timer has been cancelled, do nothing.
     if (e == boost::asio::error::operation_aborted)
       return;
 
-     // Accept new connection in io_service thread.
-    accept_one_i();
+    l->retrying = false;
+
+    // Wait for the next connection with the pending accept for rejecting.
+    if (hand_over_pending(*l))
+    {
+      if (l->stalled != 0)
+        arm_retry(l);
+
+      return;
+    }
+
+    // Accept new connections in io_service thread.
+    resume(l);
+  }
+
+  /// Handle a handler put back to the exhausted pool, can be call from any thread.
+  void handle_release(const std::vector<listener_ptr>& listeners)
+  {
+    for (size_t i = 0; i < listeners.size(); ++i)
+      listeners[i]->acceptor.get_io_service().post(boost::bind(&server::handle_release_i,
+          this,
+          listeners[i]));
+  }
+
+  /// Resume suspended accepts at once in io_service thread.
+  void handle_release_i(listener_ptr l)
+  {
+    if (l->stalled == 0 || hand_over_pending(*l))
+      return;
+
+    if (l->retrying)
+    {
+      l->retrying = false;
+
+      boost::system::error_code ignored_ec;
+      l->timer.cancel(ignored_ec);
+    }
+
+    l->retries = 0;
+    resume(l);
+  }
+
+  /// Accept a connection with a reserved socket to reject it, in io_service thread.
+  void reject_one(listener_ptr l)
+  {
+    // All reserved sockets are busy, rejecting continues when one is back.
+    if (l->reserve.empty())
+      return;
+
+    l->rejecting = true;
+
+    reject_socket_ptr socket = l->reserve.back();
+    l->reserve.pop_back();
+
+    l->acceptor.async_accept(*socket,
+        boost::bind(&server::handle_reject,
+            this,
+            boost::asio::placeholders::error,
+            socket,
+            l));
+  }
+
+  /// Handle completion of an accept for rejecting.
+  void handle_reject(const boost::system::error_code& e,
+      reject_socket_ptr socket,
+      listener_ptr l)
+  {
+    l->rejecting = false;
+
+    if (e)
+    {
+      release_socket(*l, socket);
+      return;
+    }
+
+#if BOOST_VERSION >= 106600
+    // Hand the connection over to a handler instead of rejecting it if one has been put back, and resume accepts.
+    if (hand_over(*l, socket))
+    {
+      handle_release_i(l);
+      return;
+    }
+#endif
+
+    if (admission_ == admission_busy && !busy_message_.empty())
+    {
+      // Send the busy message, the socket is back after sent.
+      boost::asio::async_write(*socket,
+          boost::asio::buffer(busy_message_),
+          boost::bind(&server::handle_busy,
+              this,
+              boost::asio::placeholders::error,
+              socket,
+              l));
+    }
+    else
+    {
+      // Reset the connection without waiting in TIME_WAIT.
+      boost::system::error_code ignored_ec;
+      socket->set_option(boost::asio::socket_base::linger(true, 0), ignored_ec);
+      release_socket(*l, socket);
+    }
+
+    // Keep rejecting while accepts are suspended.
+    if (l->stalled != 0 && !l->rejecting)
+      reject_one(l);
+  }
+
+  /// Handle completion of sending the busy message.
+  void handle_busy(const boost::system::error_code& /*e*/,
+      reject_socket_ptr socket,
+      listener_ptr l)
+  {
+    boost::system::error_code ignored_ec;
+    socket->shutdown(boost::asio::socket_base::shutdown_both, ignored_ec);
+    release_socket(*l, socket);
+
+    // Continue rejecting if it has been stopped for no reserved socket.
+    if (l->stalled != 0 && !l->rejecting)
+      reject_one(l);
+  }
+
+#if BOOST_VERSION >= 106600
+  /// Move the connection accepted by a reserved socket to a new handler and start it.
+  bool hand_over(listener& l, reject_socket_ptr socket)
+  {
+    service_handler_ptr handler = get_service_handler(l);
+    if (handler.get() == 0)
+      return false;
+
+    boost::system::error_code ec;
+    typename reject_socket_t::native_handle_type native_socket = socket->release(ec);
+    if (ec)
+      return false;
+
+    handler->socket().lowest_layer().assign(l.endpoint.protocol(), native_socket, ec);
+    if (ec)
+    {
+      // Give the connection back to the reserved socket to close it.
+      boost::system::error_code ignored_ec;
+      socket->assign(l.endpoint.protocol(), native_socket, ignored_ec);
+      release_socket(l, socket);
+
+      handler->close(ec);
+      return true;
+    }
+
+    l.reserve.push_back(socket);
+
+    // Move works of the connection to the lane of its own priority.
+    set_lane(*handler, typename work_handler_traits<Work_Handler>::handles_priority());
+
+    handler->start();
+    return true;
+  }
+#endif
+
+  /// Close a reserved socket and put it back.
+  static void release_socket(listener& l, reject_socket_ptr socket)
+  {
+    boost::system::error_code ignored_ec;
+    socket->close(ignored_ec);
+
+    l.reserve.push_back(socket);
   }
 
 private:
@@ -306,23 +957,32 @@ private:
   /// The pool of io_service objects used to perform asynchronous accept operations.
   io_service_pool acceptor_service_pool_;
 
-  /// The acceptor used to listen for incoming connections.
-  boost::asio::ip::tcp::acceptor acceptor_;
+  /// The acceptors used to listen for incoming connections.
+  std::vector<listener_ptr> listeners_;
 
-  /// The timer for repeat accept delay.
-  boost::asio::deadline_timer timer_;
+  /// The way to handle new connections when the pool is exhausted.
+  admission_t admission_;
 
-  /// The server endpoint.
-  endpoint_t endpoint_;
+  /// The message sent to rejected connections in admission_busy.
+  std::string busy_message_;
+
+  /// The endpoints to listen on.
+  std::vector<endpoint_t> endpoints_;
 
   /// The queue length for async_accept.
   size_t accept_queue_length_;
 
+  /// The priority of the works of accepted connections.
+  io_service_group::priority_t priority_;
+
+  /// Flag to indicate whether to accept with SO_REUSEPORT acceptors in io_pool.
+  bool reuse_port_;
+
   /// Flag to indicate whether the server is started.
   bool started_;
 
   /// Flag to indicate whether the server is started with blocked mode.
-  bool block_;  
+  bool block_;
 
   /// Flag to indicate whether the server has internal io_service_group.
   bool has_service_group_;
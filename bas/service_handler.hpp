@@ -13,16 +13,40 @@
 
 #include <boost/assert.hpp>
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/asio/detail/mutex.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/bind.hpp>
+#include <boost/detail/atomic_count.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
-
+#include <climits>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <bas/buffer_chain.hpp>
+#include <bas/frame_codec.hpp>
+#include <bas/handler_allocator.hpp>
 #include <bas/io_buffer.hpp>
+#include <bas/io_service_info.hpp>
+#include <bas/timing_wheel.hpp>
+#include <bas/work_handler_traits.hpp>
 
 namespace bas {
 
+/// The threshold of average execution time of callbacks in microseconds, for executing adaptive work handlers inline.
+#define BAS_ADAPTIVE_INLINE_THRESHOLD  50
+
+/// The maximum number of buffers gathered into one write operation.
+///   asio passes at most 64 buffers (max_buffers of its buffer sequence adapter) to one writev call.
+#define BAS_WRITE_MAX_BUFFERS  64
+
+/// The default maximum bytes of queued outbound data, 0 for no limit.
+#define BAS_WRITE_HIGH_WATERMARK  0
+
 /// Struct for deliver event cross multiple hander.
 struct event_t
 {
@@ -73,8 +97,21 @@ public:
   /// Define type reference of boost::asio::io_service.
   typedef boost::asio::io_service io_service_t;
 
-  /// Define type reference of boost::asio::ip::tcp::endpoint.
-  typedef boost::asio::ip::tcp::endpoint endpoint_t;
+  /// Define type reference of boost::asio::io_service::strand.
+  typedef boost::asio::io_service::strand strand_t;
+
+  /// The protocol of the socket, e.g. boost::asio::ip::tcp, boost::asio::local::stream_protocol
+  ///   or boost::asio::generic::stream_protocol for both of them.
+  typedef typename Socket_Service::lowest_layer_type::protocol_type protocol_t;
+
+  /// The type of the endpoint of the protocol.
+  typedef typename protocol_t::endpoint endpoint_t;
+
+  /// Define type reference of boost::asio::detail::mutex.
+  typedef boost::asio::detail::mutex mutex_t;
+
+  /// Define type reference of boost::asio::detail::mutex::scoped_lock.
+  typedef boost::asio::detail::mutex::scoped_lock scoped_lock_t;
 
   /// The type of the service_handler.
   typedef service_handler<Work_Handler, Socket_Service> service_handler_t;
@@ -86,29 +123,59 @@ public:
   typedef Socket_Service socket_t;
 
   /// Constructor.
+  ///   If socket_storage is not 0, the work handler is constructed in the memory of the service_handler,
+  ///   and sockets are constructed in socket_storage, which must be valid until the service_handler is destructed.
   service_handler(work_handler_t* work_handler,
       size_t read_buffer_size,
       size_t write_buffer_size = 0,
       unsigned int session_timeout = 0,
-      unsigned int io_timeout = 0)
-    : work_handler_(work_handler),
-      socket_(),
-      session_timer_(),
-      io_timer_(),
+      unsigned int io_timeout = 0,
+      void* socket_storage = 0)
+    : stopped_(true),
+      inline_(false),
+      adaptive_(false),
+      lazy_read_(false),
+      works_(0),
+      average_(0),
       io_service_(0),
       work_service_(0),
-      stopped_(true),
+      io_info_(0),
+      work_info_(0),
+      socket_(0),
+      work_handler_(work_handler),
+      strand_(),
+      wheel_(0),
+      expiry_(),
       session_timeout_(session_timeout),
       io_timeout_(io_timeout),
+      socket_storage_(socket_storage),
+      codec_(),
+      frames_(),
+      reading_frames_(false),
       read_buffer_(read_buffer_size),
-      write_buffer_(write_buffer_size)
+      write_buffer_(write_buffer_size),
+      batch_buffer_(),
+      write_mutex_(),
+      write_queue_(),
+      write_sizes_(),
+      write_batch_(),
+      write_written_(),
+      write_queued_(0),
+      write_high_watermark_(BAS_WRITE_HIGH_WATERMARK),
+      writing_(false)
   {
-    BOOST_ASSERT(work_handler_.get() != 0);
+    BOOST_ASSERT(work_handler_ != 0);
   }
 
   /// Destruct the service handler.
   ~service_handler()
   {
+    destroy_socket();
+
+    if (socket_storage_ != 0)
+      work_handler_->~work_handler_t();
+    else
+      delete work_handler_;
   }
 
   /// Get the io_buffer for incoming data.
@@ -123,6 +190,12 @@ public:
     return write_buffer_;
   }
 
+  /// Get the buffer for responses of on_read_batch, only used in on_read_batch.
+  buffer_chain& batch_buffer()
+  {
+    return batch_buffer_;
+  }
+
   /// Get the io_service object used to perform asynchronous operations.
   io_service_t& io_service()
   {
@@ -142,7 +215,7 @@ public:
   /// Get the socket associated with the service_handler.
   socket_t& socket()
   {
-    BOOST_ASSERT(socket_.get() != 0);
+    BOOST_ASSERT(socket_ != 0);
 
     return *socket_;
   }
@@ -155,9 +228,9 @@ public:
       return;
 
     // Dispatch to io_service thread.
-    io_service().dispatch(boost::bind(&service_handler_t::close_i,
-                                      shared_from_this(),
-                                      ec));
+    dispatch_io(boost::bind(&service_handler_t::close_i,
+                            shared_from_this(),
+                            ec));
   }
 
   /// Close the handler with the error_code 0 from any thread.
@@ -168,14 +241,32 @@ public:
 
   /// Start asynchronous read operation from any thread.
   /// Caller must be sure that read_buffer().space() > 0.
+  /// With a frame codec, start reading frames, following calls are ignored.
   void async_read_some()
   {
+    // Frames are read continuously after started.
+    if (codec_.get() != 0)
+    {
+      dispatch_io(boost::bind(&service_handler_t::read_frames_i,
+                              shared_from_this(),
+                              false));
+      return;
+    }
+
     if (read_buffer().space() == 0)
     {
       close(boost::asio::error::no_buffer_space);
       return;
     }
 
+    // Wait for readable without buffer, the storage of read_buffer is borrowed when data arrived.
+    if (lazy_read_)
+    {
+      dispatch_io(boost::bind(&service_handler_t::async_wait_read_i,
+                              shared_from_this()));
+      return;
+    }
+
     async_read_some(boost::asio::buffer(read_buffer().data() + read_buffer().size(), read_buffer().space()));
   }
 
@@ -183,9 +274,9 @@ public:
   template<typename Buffers>
   void async_read_some(const Buffers& buffers)
   {
-    io_service().dispatch(boost::bind(&service_handler_t::async_read_some_i<Buffers>,
-                                      shared_from_this(),
-                                      buffers));
+    dispatch_io(boost::bind(&service_handler_t::async_read_some_i<Buffers>,
+                            shared_from_this(),
+                            buffers));
   }
 
   /// Start asynchronous read operation from any thread.
@@ -205,9 +296,9 @@ public:
   template<typename Buffers>
   void async_read(const Buffers& buffers)
   {
-    io_service().dispatch(boost::bind(&service_handler_t::async_read_i<Buffers>,
-                                      shared_from_this(),
-                                      buffers));
+    dispatch_io(boost::bind(&service_handler_t::async_read_i<Buffers>,
+                            shared_from_this(),
+                            buffers));
   }
 
   /// Start asynchronous write operation from any thread.
@@ -237,28 +328,68 @@ public:
   }
 
   /// Start asynchronous write operation from any thread.
+  ///   Buffers are queued and written in order, on_write is called once for each call with its total bytes.
+  ///   Buffers must be valid until on_write is called.
   template<typename Buffers>
   void async_write(const Buffers& buffers)
   {
-    io_service().dispatch(boost::bind(&service_handler_t::async_write_i<Buffers>,
-                                      shared_from_this(),
-                                      buffers));
+    dispatch_io(boost::bind(&service_handler_t::async_write_i<Buffers>,
+                            shared_from_this(),
+                            buffers,
+                            static_cast<void*>(0)));
+  }
+
+  /// Get the bytes of outbound data queued and not yet written, can be call from any thread.
+  size_t write_queued()
+  {
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(write_mutex_);
+
+    return write_queued_;
+  }
+
+  /// Set whether async_read_some() waits for readable before using read_buffer, for mostly idle connections.
+  ///   Only for sockets support null_buffers, not for ssl. Reset to false for each connection.
+  void set_lazy_read(bool lazy_read)
+  {
+    lazy_read_ = lazy_read;
+  }
+
+  /// Set the codec for splitting incoming data into frames, must be set before reading.
+  ///   Data is decoded in io_service thread, on_read is called only with complete frames.
+  ///   Each frame is at the beginning of read_buffer() when on_read is called with its size,
+  ///   and consumed after on_read returned. All frames decoded from a read are posted together,
+  ///   and the next read is started after they are processed. Reset to none for each connection.
+  ///   If the work handler defines
+  ///     void on_read_batch(service_handler_t& handler, const bas::frame_t* frames, std::size_t count);
+  ///   it is called once for all frames instead of on_read. Data appended to batch_buffer() in it
+  ///   is copied to the outbound queue and written with one async_write after it returns,
+  ///   and on_write is called with the size.
+  void set_codec(const frame_codec_ptr& codec)
+  {
+    codec_ = codec;
+  }
+
+  /// Set the maximum bytes of queued outbound data, 0 for no limit.
+  ///   A write exceeding it closes the handler with no_buffer_space. Reset to default for each connection.
+  void set_write_high_watermark(size_t high_watermark)
+  {
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(write_mutex_);
+
+    write_high_watermark_ = high_watermark;
   }
 
   /// Post event to the child handler from the parent handler.
   void parent_post(const event_t event)
   {
-    work_service().post(boost::bind(&service_handler_t::do_parent,
-                                    shared_from_this(),
-                                    event));
+    parent_post(event, typename work_handler_traits<work_handler_t>::handles_parent());
   }
 
   /// Post event to the parent handler from the child handler.
   void child_post(const event_t event)
   {
-    work_service().post(boost::bind(&service_handler_t::do_child,
-                                    shared_from_this(),
-                                    event));
+    child_post(event, typename work_handler_traits<work_handler_t>::handles_child());
   }
 
 private:
@@ -274,48 +405,207 @@ private:
   {
     stopped_ = false;
 
-    socket_.reset(work_allocator.make_socket(io_service));
+    destroy_socket();
+    socket_ = make_socket(work_allocator, io_service, typename work_allocator_traits<Work_Allocator>::contiguous());
 
-    if (session_timeout_ != 0)
-      session_timer_.reset(new boost::asio::deadline_timer(io_service));
-    if (io_timeout_ != 0)
-      io_timer_.reset(new boost::asio::deadline_timer(io_service));
+    // Track timeouts with the timing wheel of io_service, the entry does not keep the handler alive.
+    if (session_timeout_ != 0 || io_timeout_ != 0)
+    {
+      wheel_ = &boost::asio::use_service<timing_wheel>(io_service);
+      expiry_ = wheel_->make_entry(boost::bind(&service_handler_t::handle_expiry,
+                                               boost::weak_ptr<service_handler_t>(shared_from_this())));
+    }
 
     io_service_ = &io_service;
     work_service_ = &work_service;
+    io_info_ = &boost::asio::use_service<io_service_info>(io_service);
+
+    // Callbacks of a non-blocking work handler are executed inline in io_service thread,
+    //   only if the io_service is run by one thread, so callbacks are still in order.
+    inline_ = work_handler_traits<work_handler_t>::non_blocking::value && !io_info_->concurrent();
+    if (inline_)
+      work_service_ = &io_service;
+
+    // Callbacks of an adaptive work handler are executed inline while they are short.
+    adaptive_ = work_handler_traits<work_handler_t>::adaptive::value && !io_info_->concurrent();
+    average_ = 0;
+
+    lazy_read_ = false;
+
+    // No frame codec by default.
+    codec_.reset();
+    frames_.clear();
+    reading_frames_ = false;
+
+    // Count the handler on io_service and work_service until it is cleared, once if they are the same.
+    work_info_ = &boost::asio::use_service<io_service_info>(*work_service_);
+    io_info_->attach();
+    if (work_info_ != io_info_)
+      work_info_->attach();
+
+    // Handlers of work_service maybe executed by more than one thread, use strand to keep them in order.
+    if (work_info_->concurrent())
+      strand_.reset(new strand_t(*work_service_));
 
     // Clear buffers for new operations.
     read_buffer().clear();
     write_buffer().clear();
+    clear_write_queue();
 
     // Clear work handler for new operations.
     // Only necessary operations performed and should return ASAP.
+    clear_work_handler(typename work_handler_traits<work_handler_t>::handles_clear());
+  }
+
+  /// Move works of a bound handler to another work_service before it is started, from io_service thread.
+  ///   Callbacks of a non-blocking work handler keep running in io_service thread.
+  void rebind_work(io_service_t& work_service)
+  {
+    BOOST_ASSERT(works_ == 0);
+
+    if (inline_ || work_service_ == &work_service)
+      return;
+
+    if (work_info_ != io_info_)
+      work_info_->detach();
+
+    work_service_ = &work_service;
+    work_info_ = &boost::asio::use_service<io_service_info>(work_service);
+
+    if (work_info_ != io_info_)
+      work_info_->attach();
+
+    // Handlers of the new work_service maybe executed by more than one thread.
+    if (work_info_->concurrent())
+      strand_.reset(new strand_t(work_service));
+    else
+      strand_.reset();
+  }
+
+  /// Create a socket in heap memory.
+  template<typename Work_Allocator>
+  socket_t* make_socket(Work_Allocator& work_allocator, io_service_t& io_service, boost::false_type)
+  {
+    return work_allocator.make_socket(io_service);
+  }
+
+  /// Create a socket in the memory of the service_handler.
+  template<typename Work_Allocator>
+  socket_t* make_socket(Work_Allocator& work_allocator, io_service_t& io_service, boost::true_type)
+  {
+    BOOST_ASSERT(socket_storage_ != 0);
+
+    return work_allocator.make_socket(io_service, socket_storage_);
+  }
+
+  /// Destroy the socket.
+  void destroy_socket()
+  {
+    if (socket_ == 0)
+      return;
+
+    if (socket_storage_ != 0)
+      socket_->~socket_t();
+    else
+      delete socket_;
+
+    socket_ = 0;
+  }
+
+  /// Call on_clear function of the work handler.
+  void clear_work_handler(boost::true_type)
+  {
     work_handler_->on_clear(*this);
   }
 
+  /// The work handler has no on_clear function, do nothing.
+  void clear_work_handler(boost::false_type)
+  {
+  }
+
+  /// Post event to work_service for on_parent function of the work handler.
+  void parent_post(const event_t event, boost::true_type)
+  {
+    post_event(&service_handler_t::do_parent, event);
+  }
+
+  /// The work handler has no on_parent function, drop the event.
+  void parent_post(const event_t /*event*/, boost::false_type)
+  {
+  }
+
+  /// Post event to work_service for on_child function of the work handler.
+  void child_post(const event_t event, boost::true_type)
+  {
+    post_event(&service_handler_t::do_child, event);
+  }
+
+  /// The work handler has no on_child function, drop the event.
+  void child_post(const event_t /*event*/, boost::false_type)
+  {
+  }
+
   /// Release and reset temporary variables.
   void clear()
   {
-    // Release allocated socket.
-    socket_.reset();
+    // Release allocated socket and strand.
+    destroy_socket();
+    strand_.reset();
 
     // Reset io_service and work_service.
     io_service_ = 0;
     work_service_ = 0;
 
-    // Clear buffers for new operations.
+    // The handler is no longer bound with io_service and work_service.
+    if (io_info_ != 0)
+      io_info_->detach();
+    if (work_info_ != 0 && work_info_ != io_info_)
+      work_info_->detach();
+
+    io_info_ = 0;
+    work_info_ = 0;
+
+    // Release the entry of timing wheel.
+    wheel_ = 0;
+    expiry_.reset();
+
+    // Clear buffers for new operations, no operation is using them now, so an idle handler holds no storage.
     read_buffer().clear();
+    read_buffer().shrink();
     write_buffer().clear();
+    write_buffer().shrink();
+    batch_buffer_.clear();
+    clear_write_queue();
+  }
+
+  /// Clear the outbound queue for next connection.
+  void clear_write_queue()
+  {
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(write_mutex_);
+
+    write_queue_.clear();
+
+    // Put back the storage of messages not written.
+    for (size_t i = 0; i < write_sizes_.size(); ++i)
+      if (write_sizes_[i].storage != 0)
+        slab_pool::global().deallocate(write_sizes_[i].storage, write_sizes_[i].bytes);
+
+    write_sizes_.clear();
+    write_batch_.clear();
+    write_queued_ = 0;
+    write_high_watermark_ = BAS_WRITE_HIGH_WATERMARK;
+    writing_ = false;
   }
 
   /// Start asynchronous connect, can be call from any thread.
   void connect(endpoint_t& peer_endpoint,
                endpoint_t& local_endpoint = endpoint_t())
   {
-    io_service().dispatch(boost::bind(&service_handler_t::connect_i,
-                                      shared_from_this(),
-                                      peer_endpoint,
-                                      local_endpoint));
+    dispatch_io(boost::bind(&service_handler_t::connect_i,
+                            shared_from_this(),
+                            peer_endpoint,
+                            local_endpoint));
   }
 
   /// Start asynchronous connect, can be call from any thread.
@@ -327,16 +617,16 @@ private:
     // Set per_connection_data.
     work_handler_->set_data(data);
 
-    io_service().dispatch(boost::bind(&service_handler_t::connect_i,
-                                      shared_from_this(),
-                                      peer_endpoint,
-                                      local_endpoint));
+    dispatch_io(boost::bind(&service_handler_t::connect_i,
+                            shared_from_this(),
+                            peer_endpoint,
+                            local_endpoint));
   }
 
   /// Start the first operation, can be call from any thread.
   void start()
   {
-    BOOST_ASSERT(socket_.get() != 0);
+    BOOST_ASSERT(socket_ != 0);
     BOOST_ASSERT(io_service_ != 0);
     BOOST_ASSERT(work_service_ != 0);
 
@@ -344,15 +634,131 @@ private:
     set_session_expiry();
 
     // Post to work_service for executing do_open.
-    work_service().post(boost::bind(&service_handler_t::do_open,
-                                    shared_from_this()));
+    post_work(boost::bind(&service_handler_t::do_open,
+                          shared_from_this()));
+  }
+
+  /// Dispatch a handler to io_service thread, use the handler memory of the service_handler if it is not in use.
+  template<typename Handler>
+  void dispatch_io(Handler handler)
+  {
+    io_service().dispatch(make_custom_alloc_handler(dispatch_allocator_, handler));
+  }
+
+  /// Post a handler to work_service, serialized by strand if necessary.
+  template<typename Handler>
+  void post_work(Handler handler)
+  {
+    // Count the work of the handler until it is finished.
+    ++works_;
+
+    // Count the handler as pending on work_service until it is finished.
+    work_info_->enqueue();
+
+    // Use the handler memory of the service_handler, no allocation in most cases.
+    if (strand_.get() != 0)
+      strand_->post(make_custom_alloc_handler(post_allocator_, handler));
+    else
+      work_service().post(make_custom_alloc_handler(post_allocator_, handler));
+  }
+
+  /// Execute a handler of i/o completion from io_service thread, inline if the work handler is non-blocking,
+  ///   or it is adaptive and its callbacks are short.
+  template<typename Handler>
+  void run_work(Handler handler)
+  {
+    // Adaptive handler runs inline only if no work in work_service, so works are still in order.
+    //   Works of adaptive handler are posted from io_service thread only, works_ can't be increased by others.
+    if (inline_ || (adaptive_ && works_ == 0 && (average_.load(boost::memory_order_relaxed) >> 3) < BAS_ADAPTIVE_INLINE_THRESHOLD))
+    {
+      // Count as posted work too, the handler will uncount itself.
+      ++works_;
+      work_info_->enqueue();
+
+      handler();
+    }
+    else
+      post_work(handler);
+  }
+
+  /// Post event to work_service.
+  void post_event(void (service_handler_t::*handler)(const event_t), const event_t event)
+  {
+    // Post from io_service thread for adaptive handler.
+    if (adaptive_)
+      dispatch_io(boost::bind(&service_handler_t::post_event_i,
+                              shared_from_this(),
+                              handler,
+                              event));
+    else
+      post_event_i(handler, event);
+  }
+
+  /// Post event to work_service from io_service thread or any thread.
+  void post_event_i(void (service_handler_t::*handler)(const event_t), const event_t event)
+  {
+    post_work(boost::bind(handler,
+                          shared_from_this(),
+                          event));
   }
 
+  /// Guard for counting a work of the handler from started to finished in work_service thread.
+  class work_guard
+    : private boost::noncopyable
+  {
+  public:
+    /// Start a work.
+    explicit work_guard(service_handler_t& handler)
+      : handler_(handler),
+        info_(handler.work_info_),
+        start_()
+    {
+      if (handler_.adaptive_)
+        start_ = boost::posix_time::microsec_clock::universal_time();
+    }
+
+    /// Finish the work.
+    ~work_guard()
+    {
+      // Update moving average of execution time with weight 1/8, the average is kept scaled by 8,
+      //   so it decays to zero without truncation. Works may finish in different work_service threads.
+      if (handler_.adaptive_)
+      {
+        long elapsed = static_cast<long>((boost::posix_time::microsec_clock::universal_time() - start_).total_microseconds());
+        if (elapsed < 0)
+          elapsed = 0;
+
+        long average = handler_.average_.load(boost::memory_order_relaxed);
+        while (!handler_.average_.compare_exchange_weak(average,
+                                                       average + elapsed - (average >> 3),
+                                                       boost::memory_order_relaxed))
+        {
+        }
+      }
+
+      // The handler is no longer pending on work_service, even if the callback throws.
+      info_->dequeue();
+
+      // Release after average_ is updated.
+      --handler_.works_;
+    }
+
+  private:
+    /// The handler of the work.
+    service_handler_t& handler_;
+
+    /// The information of work_service the work was counted on.
+    io_service_info* info_;
+
+    /// The start time of the work.
+    boost::posix_time::ptime start_;
+  };
+
 private:
   /// Start an asynchronous connect from io_service thread.
   void connect_i(endpoint_t& peer_endpoint, endpoint_t& local_endpoint)
   {
-    BOOST_ASSERT(socket_.get() != 0);
+    BOOST_ASSERT(socket_ != 0);
     BOOST_ASSERT(io_service_ != 0);
     BOOST_ASSERT(work_service_ != 0);
 
@@ -379,9 +785,10 @@ private:
 
     // Use lowest_layer socket for ssl.
     socket().lowest_layer().async_connect(peer_endpoint,
-                                boost::bind(&service_handler_t::handle_connect,
-                                            shared_from_this(),
-                                            boost::asio::placeholders::error));
+                                make_custom_alloc_handler(write_allocator_,
+                                    boost::bind(&service_handler_t::handle_connect,
+                                                shared_from_this(),
+                                                boost::asio::placeholders::error)));
   }
 
   /// Start an asynchronous operation from io_service thread to read any amount of data to buffers from the socket.
@@ -396,10 +803,103 @@ private:
     set_io_expiry();
 
     socket().async_read_some(buffers,
-                  boost::bind(&service_handler_t::handle_read,
-                              shared_from_this(),
-                              boost::asio::placeholders::error,
-                              boost::asio::placeholders::bytes_transferred));
+                  make_custom_alloc_handler(read_allocator_,
+                      boost::bind(&service_handler_t::handle_read,
+                                  shared_from_this(),
+                                  boost::asio::placeholders::error,
+                                  boost::asio::placeholders::bytes_transferred)));
+  }
+
+  /// Start reading frames from io_service thread, or continue after frames are processed.
+  void read_frames_i(bool next)
+  {
+    // The handler has been stopped, do nothing.
+    if (stopped_)
+      return;
+
+    // Reading is already started.
+    if (!next)
+    {
+      if (reading_frames_)
+        return;
+
+      reading_frames_ = true;
+    }
+
+    // Move the incomplete frame to the beginning for more data.
+    if (read_buffer().space() == 0)
+      read_buffer().crunch();
+
+    if (read_buffer().space() == 0)
+      close_i(boost::asio::error::no_buffer_space);
+    else if (lazy_read_ && read_buffer().empty())
+      async_wait_read_i();
+    else
+      async_read_some_i(boost::asio::buffer(read_buffer().data() + read_buffer().size(), read_buffer().space()));
+  }
+
+  /// Decode complete frames in read_buffer from io_service thread, read more if no complete frame.
+  void decode_i()
+  {
+    frames_.clear();
+
+    const io_buffer::byte_t* data = read_buffer().data();
+    size_t size = read_buffer().size();
+    while (size != 0)
+    {
+      size_t frame = codec_->frame_size(data, size);
+      if (frame == frame_codec::invalid_frame)
+      {
+        close_i(boost::system::errc::make_error_code(boost::system::errc::bad_message));
+        return;
+      }
+
+      // The frame can't be held by read_buffer.
+      if (frame > read_buffer().capacity())
+      {
+        close_i(boost::asio::error::no_buffer_space);
+        return;
+      }
+
+      if (frame == 0 || frame > size)
+        break;
+
+      frame_t view = { data, frame };
+      frames_.push_back(view);
+      data += frame;
+      size -= frame;
+    }
+
+    // No complete frame, read more without leaving io_service thread.
+    if (frames_.empty())
+    {
+      read_frames_i(true);
+      return;
+    }
+
+    // Post to work_service or execute inline for executing do_read_frames.
+    run_work(boost::bind(&service_handler_t::do_read_frames,
+                         shared_from_this()));
+  }
+
+  /// Start an asynchronous operation from io_service thread to wait for the socket readable.
+  void async_wait_read_i()
+  {
+    // The handler has been stopped, do nothing.
+    if (stopped_)
+      return;
+
+    // No read is using read_buffer while waiting, put back its storage if it is empty.
+    read_buffer().shrink();
+
+    // Set timer for i/o operation timeout.
+    set_io_expiry();
+
+    socket().async_read_some(boost::asio::null_buffers(),
+                  make_custom_alloc_handler(read_allocator_,
+                      boost::bind(&service_handler_t::handle_readable,
+                                  shared_from_this(),
+                                  boost::asio::placeholders::error)));
   }
 
   /// Start an asynchronous operation from io_service thread to read a certain amount of data to buffers from the socket.
@@ -415,67 +915,115 @@ private:
 
     boost::asio::async_read(socket(),
                      buffers,
-                     boost::bind(&service_handler_t::handle_read,
-                                 shared_from_this(),
-                                 boost::asio::placeholders::error,
-                                 boost::asio::placeholders::bytes_transferred));
+                     make_custom_alloc_handler(read_allocator_,
+                         boost::bind(&service_handler_t::handle_read,
+                                     shared_from_this(),
+                                     boost::asio::placeholders::error,
+                                     boost::asio::placeholders::bytes_transferred)));
   }
 
-  /// Start an asynchronous operation from io_service thread to write buffers to the socket.
+  /// Queue buffers from io_service thread and start writing if no write operation in progress.
+  ///   The storage of the buffers is owned by the queue if it is not 0, and put back after written.
   template<typename Buffers>
-  void async_write_i(const Buffers& buffers)
+  void async_write_i(const Buffers& buffers, void* storage)
   {
     // The handler has been stopped, do nothing.
     if (stopped_)
+    {
+      if (storage != 0)
+        slab_pool::global().deallocate(storage, boost::asio::buffer_size(buffers));
+
+      return;
+    }
+
+    bool overflow = false;
+
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(write_mutex_);
+
+      size_t bytes = 0;
+      for (typename Buffers::const_iterator i = buffers.begin(); i != buffers.end(); ++i)
+      {
+        boost::asio::const_buffer buffer(*i);
+        if (boost::asio::buffer_size(buffer) == 0)
+          continue;
+
+        write_queue_.push_back(buffer);
+        bytes += boost::asio::buffer_size(buffer);
+      }
+
+      write_message message = { bytes, bytes, storage };
+      write_sizes_.push_back(message);
+      write_queued_ += bytes;
+
+      overflow = (write_high_watermark_ != 0) && (write_queued_ > write_high_watermark_);
+      if (!overflow)
+        start_write();
+    }
+
+    // Too many data queued, the peer can't keep up.
+    if (overflow)
+      close_i(boost::asio::error::no_buffer_space);
+  }
+
+  /// Gather queued buffers and write them with one operation, caller must hold write_mutex_.
+  void start_write()
+  {
+    if (writing_ || write_sizes_.empty())
       return;
 
+    writing_ = true;
+
+    write_batch_.clear();
+    while (!write_queue_.empty() && write_batch_.size() < BAS_WRITE_MAX_BUFFERS)
+    {
+      write_batch_.push_back(write_queue_.front());
+      write_queue_.pop_front();
+    }
+
     // Set timer for i/o operation timeout.
     set_io_expiry();
 
     boost::asio::async_write(socket(),
-                     buffers,
-                     boost::bind(&service_handler_t::handle_write,
-                                 shared_from_this(),
-                                 boost::asio::placeholders::error,
-                                 boost::asio::placeholders::bytes_transferred));
+                     write_batch_,
+                     make_custom_alloc_handler(write_allocator_,
+                         boost::bind(&service_handler_t::handle_write,
+                                     shared_from_this(),
+                                     boost::asio::placeholders::error,
+                                     boost::asio::placeholders::bytes_transferred)));
   }
 
   /// Set timer for session timeout.
   void set_session_expiry(void)
   {
-    if ((session_timeout_ == 0) || (session_timer_.get() == 0))
+    if ((session_timeout_ == 0) || (expiry_.get() == 0))
       return;
 
-    session_timer_->expires_from_now(boost::posix_time::seconds(session_timeout_));
-    session_timer_->async_wait(boost::bind(&service_handler_t::handle_timeout,
-                                           shared_from_this(),
-                                           boost::asio::placeholders::error));
+    wheel_->set_session(expiry_, session_timeout_);
   }
 
   /// Cancel timer for session timeout.
   void cancel_session_expiry(void)
   {
-    if (session_timer_.get() != 0)
-      session_timer_->cancel();
+    if (expiry_.get() != 0)
+      wheel_->set_session(expiry_, 0);
   }
 
   /// Set timer for i/o operation timeout.
   void set_io_expiry(void)
   {
-    if ((io_timeout_ == 0) || (io_timer_.get() == 0))
+    if ((io_timeout_ == 0) || (expiry_.get() == 0))
       return;
 
-    io_timer_->expires_from_now(boost::posix_time::seconds(io_timeout_));
-    io_timer_->async_wait(boost::bind(&service_handler_t::handle_timeout,
-                                      shared_from_this(),
-                                      boost::asio::placeholders::error));
+    wheel_->set_io(expiry_, io_timeout_);
   }
 
   /// Cancel timer for i/o operation timeout.
   void cancel_io_expiry(void)
   {
-    if (io_timer_.get() != 0)
-      io_timer_->cancel();
+    if (expiry_.get() != 0)
+      wheel_->set_io(expiry_, 0);
   }
 
   /// Handle completion of a connect operation in io_service thread.
@@ -494,6 +1042,24 @@ private:
       close_i(ec);
   }
 
+  /// Handle the socket readable in io_service thread, read to read_buffer now.
+  void handle_readable(const boost::system::error_code& ec)
+  {
+    // The handler is stopped, do nothing.
+    if (stopped_)
+      return;
+
+    // Cancel timer for i/o operation timeout, even if expired.
+    cancel_io_expiry();
+
+    if (ec)
+      close_i(ec);
+    else if (read_buffer().space() == 0)
+      close_i(boost::asio::error::no_buffer_space);
+    else
+      async_read_some_i(boost::asio::buffer(read_buffer().data() + read_buffer().size(), read_buffer().space()));
+  }
+
   /// Handle completion of a read operation in io_service thread.
   void handle_read(const boost::system::error_code& ec, size_t bytes_transferred)
   {
@@ -504,15 +1070,21 @@ private:
     // Cancel timer for i/o operation timeout, even if expired.
     cancel_io_expiry();
 
-    if (!ec)
+    if (ec)
+      close_i(ec);
+    else if (codec_.get() != 0)
     {
-      // Post to work_service for executing do_read.
-      work_service().post(boost::bind(&service_handler_t::do_read,
-                                      shared_from_this(),
-                                      bytes_transferred));
+      // Decode frames in io_service thread.
+      read_buffer().produce(bytes_transferred);
+      decode_i();
     }
     else
-      close_i(ec);
+    {
+      // Post to work_service or execute inline for executing do_read.
+      run_work(boost::bind(&service_handler_t::do_read,
+                           shared_from_this(),
+                           bytes_transferred));
+    }
   }
 
   /// Handle completion of a write operation in io_service thread.
@@ -525,25 +1097,87 @@ private:
     // Cancel timer for i/o operation timeout, even if expired.
     cancel_io_expiry();
 
-    if (!ec)
+    if (ec)
     {
-      // Post to work_service for executing do_write.
-      work_service().post(boost::bind(&service_handler_t::do_write,
-                                      shared_from_this(),
-                                      bytes_transferred));
-    }
-    else
       close_i(ec);
+      return;
+    }
+
+    // Keep writing_ set while reporting, so no other write completion touches write_written_.
+    write_written_.clear();
+
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(write_mutex_);
+
+      write_queued_ -= bytes_transferred;
+
+      // A message with empty buffers completes with the one before it.
+      while (!write_sizes_.empty())
+      {
+        write_message& message = write_sizes_.front();
+        if (message.remaining > bytes_transferred)
+        {
+          message.remaining -= bytes_transferred;
+          break;
+        }
+
+        bytes_transferred -= message.remaining;
+        write_written_.push_back(message.bytes);
+
+        // The message is written, put back its storage.
+        if (message.storage != 0)
+          slab_pool::global().deallocate(message.storage, message.bytes);
+
+        write_sizes_.pop_front();
+      }
+    }
+
+    // Report each message, without lock for writing again from on_write.
+    for (size_t i = 0; i < write_written_.size(); ++i)
+      report_write(write_written_[i], typename work_handler_traits<work_handler_t>::handles_write());
+
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(write_mutex_);
+
+      // Continue with buffers queued while writing and reporting.
+      writing_ = false;
+      start_write();
+    }
+  }
+
+  /// Report a message written to on_write function of the work handler.
+  void report_write(size_t bytes_transferred, boost::true_type)
+  {
+    // Post to work_service or execute inline for executing do_write.
+    run_work(boost::bind(&service_handler_t::do_write,
+                         shared_from_this(),
+                         bytes_transferred));
+  }
+
+  /// The work handler has no on_write function, do nothing.
+  void report_write(size_t /*bytes_transferred*/, boost::false_type)
+  {
+  }
+
+  /// Handle expiry of the timing wheel entry in io_service thread.
+  static void handle_expiry(boost::weak_ptr<service_handler_t> handler)
+  {
+    // The handler has been put back to the pool, do nothing.
+    boost::shared_ptr<service_handler_t> service_handler = handler.lock();
+    if (service_handler.get() != 0)
+      service_handler->handle_timeout();
   }
 
   /// Handle timeout in io_service thread.
-  void handle_timeout(const boost::system::error_code& ec)
+  void handle_timeout()
   {
-    // The handler is stopped or timer is cancelled, do nothing.
-    if (stopped_ || ec == boost::asio::error::operation_aborted)
+    // The handler is stopped, do nothing.
+    if (stopped_)
       return;
 
-    close_i((ec) ? ec : boost::asio::error::timed_out);
+    close_i(boost::asio::error::timed_out);
   }
 
   /// Close the handler in io_service thread.
@@ -558,20 +1192,59 @@ private:
       socket().lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
       socket().lowest_layer().close(ignored_ec);
 
-      // Timer is not expired or expired but not dispatched, cancel it.
-      cancel_session_expiry();
-      cancel_io_expiry();
+      // Timeout is not expired, cancel it.
+      if (expiry_.get() != 0)
+        wheel_->cancel(expiry_);
 
       // Post to work_service to executing do_close.
-      work_service().post(boost::bind(&service_handler_t::do_close,
-                                      shared_from_this(),
-                                      ec));
+      post_work(boost::bind(&service_handler_t::do_close,
+                            shared_from_this(),
+                            ec));
+    }
+  }
+
+  /// Call on_read function of the work handler with each frame at the beginning of read_buffer.
+  void read_frames(boost::false_type)
+  {
+    for (size_t i = 0; i < frames_.size(); ++i)
+    {
+      work_handler_->on_read(*this, frames_[i].size);
+      read_buffer().consume(frames_[i].size);
     }
   }
 
+  /// Call on_read_batch function of the work handler with all frames, then write the responses together.
+  void read_frames(boost::true_type)
+  {
+    work_handler_->on_read_batch(*this, &frames_[0], frames_.size());
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < frames_.size(); ++i)
+      bytes += frames_[i].size;
+    read_buffer().consume(bytes);
+
+    size_t length = batch_buffer_.size();
+    if (length == 0)
+      return;
+
+    // Copy the responses to storage owned by the outbound queue, so the next batch can reuse batch_buffer.
+    void* storage = slab_pool::global().allocate(length);
+    batch_buffer_.copy(length, static_cast<buffer_chain::byte_t*>(storage));
+    batch_buffer_.consume(length);
+
+    boost::asio::const_buffers_1 buffers(storage, length);
+    dispatch_io(boost::bind(&service_handler_t::async_write_i<boost::asio::const_buffers_1>,
+                            shared_from_this(),
+                            buffers,
+                            storage));
+  }
+
   /// Do on_open in work_service thread.
   void do_open()
   {
+    // Count the work until it is finished.
+    work_guard guard(*this);
+
     // The handler is stopped, do nothing.
     if (stopped_)
       return;
@@ -583,6 +1256,9 @@ private:
   /// Do on_read in work_service thread.
   void do_read(size_t bytes_transferred)
   {
+    // Count the work until it is finished.
+    work_guard guard(*this);
+
     // The handler is stopped, do nothing.
     if (stopped_)
       return;
@@ -591,9 +1267,31 @@ private:
     work_handler_->on_read(*this, bytes_transferred);
   }
 
+  /// Do on_read for each decoded frame and continue reading in work_service thread.
+  void do_read_frames()
+  {
+    // Count the work until it is finished.
+    work_guard guard(*this);
+
+    // The handler is stopped, do nothing.
+    if (stopped_)
+      return;
+
+    // Call on_read_batch or on_read function of the work handler.
+    read_frames(typename work_handler_traits<work_handler_t>::read_batch());
+
+    // Read next frames in io_service thread.
+    dispatch_io(boost::bind(&service_handler_t::read_frames_i,
+                            shared_from_this(),
+                            true));
+  }
+
   /// Do on_write in work_service thread.
   void do_write(size_t bytes_transferred)
   {
+    // Count the work until it is finished.
+    work_guard guard(*this);
+
     // The handler is stopped, do nothing.
     if (stopped_)
       return;
@@ -611,9 +1309,22 @@ private:
       return;
 
     // Call on_set_parent function of the work handler.
+    set_parent(handler, typename work_handler_traits<work_handler_t>::handles_set_parent());
+  }
+
+  /// Call on_set_parent function of the work handler.
+  template<typename Parent_Handler>
+  void set_parent(Parent_Handler& handler, boost::true_type)
+  {
     work_handler_->on_set_parent(*this, handler);
   }
 
+  /// The work handler has no on_set_parent function, do nothing.
+  template<typename Parent_Handler>
+  void set_parent(Parent_Handler& /*handler*/, boost::false_type)
+  {
+  }
+
   /// Set the child handler in work_service thread.
   template<typename Child_Handler>
   void set_child(Child_Handler& handler)
@@ -623,12 +1334,28 @@ private:
       return;
 
     // Call on_set_child function of the work handler.
+    set_child(handler, typename work_handler_traits<work_handler_t>::handles_set_child());
+  }
+
+  /// Call on_set_child function of the work handler.
+  template<typename Child_Handler>
+  void set_child(Child_Handler& handler, boost::true_type)
+  {
     work_handler_->on_set_child(*this, handler);
   }
 
+  /// The work handler has no on_set_child function, do nothing.
+  template<typename Child_Handler>
+  void set_child(Child_Handler& /*handler*/, boost::false_type)
+  {
+  }
+
   /// Do on_parent in work_service thread.
   void do_parent(const event_t event)
   {
+    // Count the work until it is finished.
+    work_guard guard(*this);
+
     // The handler is stopped, do nothing.
     if (stopped_)
       return;
@@ -640,6 +1367,9 @@ private:
   /// Do on_child in work_service thread.
   void do_child(const event_t event)
   {
+    // Count the work until it is finished.
+    work_guard guard(*this);
+
     // The handler is stopped, do nothing.
     if (stopped_)
       return;
@@ -651,38 +1381,50 @@ private:
   /// Do on_close and reset handler for next connaction in work_service thread.
   void do_close(const boost::system::error_code& ec)
   {
+    // Count the work until it is finished.
+    work_guard guard(*this);
+
     // Call on_close function of the work handler.
     work_handler_->on_close(*this, ec);
 
-    // Destroy all timer.
-    session_timer_.reset();
-    io_timer_.reset();
-
     // Leave socket/io_service_/work_service_ for finishing uncompleted operations.
   }
 
 private:
-  typedef boost::shared_ptr<work_handler_t> work_handler_ptr;
-  typedef boost::shared_ptr<socket_t> socket_ptr;
-  typedef boost::shared_ptr<boost::asio::deadline_timer> timer_ptr;
+  typedef boost::shared_ptr<strand_t> strand_ptr;
 
-  /// Work handler of the service_handler.
-  work_handler_ptr work_handler_;
+  /// A message in the outbound queue.
+  struct write_message
+  {
+    /// The total bytes of the message.
+    size_t bytes;
 
-  /// Socket for the service_handler.
-  socket_ptr socket_;
+    /// The bytes not yet written.
+    size_t remaining;
 
-  /// Timer for session timeout.
-  timer_ptr session_timer_;
+    /// The storage of the message from slab_pool, owned by the queue, 0 if owned by the caller.
+    void* storage;
+  };
 
-  /// The expiry seconds of session.
-  unsigned int session_timeout_;
+  // Fields used by every operation are grouped at the beginning.
 
-  /// Timer for i/o operation timeout.
-  timer_ptr io_timer_;
+  /// Flag to indicate the handler is stopped or not.
+  bool stopped_;
 
-  /// The expiry seconds of i/o operation.
-  unsigned int io_timeout_;
+  /// Flag to indicate callbacks of the work handler are executed inline in io_service thread.
+  bool inline_;
+
+  /// Flag to indicate callbacks of the work handler are executed inline or not by their execution time.
+  bool adaptive_;
+
+  /// Flag to indicate async_read_some() waits for readable before using read_buffer.
+  bool lazy_read_;
+
+  /// The number of works posted and not finished.
+  boost::detail::atomic_count works_;
+
+  /// The moving average of execution time of callbacks in microseconds, scaled by 8.
+  boost::atomic<long> average_;
 
   /// The io_service object for executing asynchronous operations.
   io_service_t* io_service_;
@@ -690,14 +1432,89 @@ private:
   /// The io_service object for executing synchronous works.
   io_service_t* work_service_;
 
-  /// Flag to indicate the handler is stopped or not.
-  bool stopped_;
+  /// The information of io_service.
+  io_service_info* io_info_;
+
+  /// The information of work_service.
+  io_service_info* work_info_;
+
+  /// Socket for the service_handler.
+  socket_t* socket_;
+
+  /// Work handler of the service_handler.
+  work_handler_t* work_handler_;
+
+  /// Strand for keeping the order of works when work_service is concurrent.
+  strand_ptr strand_;
+
+  /// The timing wheel of io_service for tracking timeouts.
+  timing_wheel* wheel_;
+
+  /// The timing wheel entry of session and i/o operation timeouts.
+  timing_wheel::entry_ptr expiry_;
+
+  /// The expiry seconds of session.
+  unsigned int session_timeout_;
+
+  /// The expiry seconds of i/o operation.
+  unsigned int io_timeout_;
+
+  /// The memory for constructing sockets, 0 if sockets are in heap memory.
+  void* socket_storage_;
+
+  /// The codec for splitting incoming data into frames.
+  frame_codec_ptr codec_;
+
+  /// The frames decoded and not yet processed.
+  std::vector<frame_t> frames_;
+
+  /// Flag to indicate frames are being read.
+  bool reading_frames_;
 
   /// Buffer for incoming data.
   io_buffer read_buffer_;
 
   /// Buffer for outcoming data.
   io_buffer write_buffer_;
+
+  /// Buffer for responses of on_read_batch.
+  buffer_chain batch_buffer_;
+
+  /// Mutex for synchronize access to the outbound queue.
+  mutex_t write_mutex_;
+
+  /// Buffers queued and not yet gathered for writing.
+  std::deque<boost::asio::const_buffer> write_queue_;
+
+  /// The total and remaining bytes of each queued message.
+  std::deque<write_message> write_sizes_;
+
+  /// Buffers of the write operation in progress.
+  std::vector<boost::asio::const_buffer> write_batch_;
+
+  /// Sizes of the messages completed by the last write, kept for its capacity.
+  std::vector<size_t> write_written_;
+
+  /// The bytes of outbound data queued and not yet written.
+  size_t write_queued_;
+
+  /// The maximum bytes of queued outbound data, 0 for no limit.
+  size_t write_high_watermark_;
+
+  /// Flag to indicate a write operation is in progress.
+  bool writing_;
+
+  /// Handler memory for read operations.
+  handler_allocator read_allocator_;
+
+  /// Handler memory for connect and write operations.
+  handler_allocator write_allocator_;
+
+  /// Handler memory for works posted to work_service.
+  handler_allocator post_allocator_;
+
+  /// Handler memory for calls dispatched to io_service thread.
+  handler_allocator dispatch_allocator_;
 };
 
 } // namespace bas
@@ -12,11 +12,22 @@
 #define BAS_SERVICE_HANDLER_POOL_HPP
 
 #include <boost/assert.hpp>
+#include <boost/asio.hpp>
 #include <boost/asio/detail/mutex.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
+#include <boost/detail/atomic_count.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/lockfree/stack.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <algorithm>
+#include <new>
 #include <vector>
 
 #include <bas/service_handler.hpp>
@@ -28,11 +39,17 @@ namespace bas {
 #define BAS_HANDLER_POOL_HIGH_WATERMARK  5000
 #define BAS_HANDLER_POOL_INCREMENT       500
 #define BAS_HANDLER_POOL_MAXIMUM         50000
+#define BAS_HANDLER_POOL_THREAD_CACHE    16
+
+#define BAS_HANDLER_POOL_MAINTAIN_INTERVAL  1000
+#define BAS_HANDLER_POOL_PREWARM_TICKS      4
 
 #define BAS_HANDLER_BUFFER_DEFAULT_SIZE  256
 #define BAS_HANDLER_DEFAULT_TIMEOUT      30
 
 /// A pool of service_handler objects.
+///   Free handlers are kept in a lock-free list shared by all threads, with a small cache in front of it for each thread.
+///   Each cache has its own mutex, which is only contended when handlers are stolen from it or the pool is clearing.
 template<typename Work_Handler, typename Work_Allocator, typename Socket_Service = boost::asio::ip::tcp::socket>
 class service_handler_pool
   : public boost::enable_shared_from_this<service_handler_pool<Work_Handler, Work_Allocator, Socket_Service> >,
@@ -58,6 +75,9 @@ public:
   typedef Work_Allocator work_allocator_t;
   typedef boost::shared_ptr<work_allocator_t> work_allocator_ptr;
 
+  /// The type of the callback executed when a handler is put back to an exhausted pool.
+  typedef boost::function<void ()> release_callback_t;
+
   /// Constructor.
   service_handler_pool(work_allocator_t* work_allocator,
       size_t pool_init_size = BAS_HANDLER_POOL_INIT_SIZE,
@@ -70,19 +90,35 @@ public:
       size_t pool_increment = BAS_HANDLER_POOL_INCREMENT,
       size_t pool_maximum = BAS_HANDLER_POOL_MAXIMUM)
     : mutex_(),
-      service_handlers_(),
+      create_mutex_(),
+      handler_count_(0),
+      load_(0),
+      closed_(true),
+      service_handlers_(pool_high_watermark),
+      free_count_(0),
+      cached_count_(0),
+      cache_(&service_handler_pool::no_cleanup),
+      caches_(),
+      maintain_service_(0),
+      maintain_timer_(),
+      maintain_interval_(0),
+      refilling_(false),
+      last_load_(0),
+      release_mutex_(),
+      release_condition_(),
+      release_callback_(),
+      releasing_(0),
+      exhausted_(false),
       work_allocator_(work_allocator),
-      read_buffer_size_(read_buffer_size),
-      write_buffer_size_(write_buffer_size),
-      session_timeout_(session_timeout),
-      io_timeout_(io_timeout),
       pool_init_size_(pool_init_size),
       pool_low_watermark_(pool_low_watermark),
       pool_high_watermark_(pool_high_watermark),
       pool_increment_(pool_increment),
       pool_maximum_(pool_maximum),
-      handler_count_(0),
-      closed_(true)
+      read_buffer_size_(read_buffer_size),
+      write_buffer_size_(write_buffer_size),
+      session_timeout_(session_timeout),
+      io_timeout_(io_timeout)
   {
     BOOST_ASSERT(work_allocator_.get() != 0);
     BOOST_ASSERT(pool_init_size_ != 0);
@@ -95,6 +131,10 @@ public:
   /// Destruct the pool object.
   ~service_handler_pool()
   {
+    // Delete handlers left in the pool.
+    closed_ = true;
+    drain();
+
     work_allocator_.reset();
   }
 
@@ -102,9 +142,6 @@ public:
   ///   Note: shared_from_this() can't be used in the constructor.
   void init(void)
   {
-    // Lock for synchronize access to data.
-    scoped_lock_t lock(mutex_);
-
     closed_ = false;
 
     // Create preallocated handlers to the pool.
@@ -112,13 +149,65 @@ public:
   }
 
   /// Release all handlers in the pool.
-  ///   Note: close() can't be used in the destructor.
   void close(void)
   {
+    stop_maintenance();
+
     // Release all handlers in the pool.
     clear();
   }
 
+  /// Start a task in the io_service to maintain the pool every interval milliseconds, 0 for no maintenance.
+  ///   It creates handlers ahead of the growing load, and deletes idle handlers gradually when the load is not growing.
+  void start_maintenance(boost::asio::io_service& io_service,
+      unsigned int interval = BAS_HANDLER_POOL_MAINTAIN_INTERVAL)
+  {
+    if (interval == 0)
+      return;
+
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    if (maintain_timer_.get() != 0)
+      return;
+
+    maintain_service_ = &io_service;
+    maintain_interval_ = interval;
+    last_load_ = get_load();
+    refilling_ = false;
+    maintain_timer_.reset(new boost::asio::deadline_timer(io_service));
+    arm_maintenance();
+  }
+
+  /// Stop the maintenance task, must be called before the io_service is stopped.
+  void stop_maintenance(void)
+  {
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    if (maintain_timer_.get() == 0)
+      return;
+
+    boost::system::error_code ignored_ec;
+    maintain_timer_->cancel(ignored_ec);
+    maintain_timer_.reset();
+  }
+
+  /// Set the callback executed when a handler is put back after the pool has been exhausted.
+  ///   The callback may be executed in any thread, it must be short and never get handlers from the pool.
+  ///   Return after the callbacks in progress have finished, so the old callback is never executed again,
+  ///   must not be called from the callback.
+  void set_release_callback(const release_callback_t& callback)
+  {
+    // Lock for synchronize access to data.
+    boost::mutex::scoped_lock lock(release_mutex_);
+
+    release_callback_ = callback;
+
+    while (releasing_ != 0)
+      release_condition_.wait(lock);
+  }
+
   /// Get an service_handler to use.
   service_handler_ptr get_service_handler(boost::asio::io_service& io_service,
       boost::asio::io_service& work_service)
@@ -131,6 +220,9 @@ public:
     {
       // Bind the handler with given io_service and work_service.
       service_handler->bind(io_service, work_service, work_allocator());
+
+      // The handler is active until it is put back.
+      ++load_;
     }
 
     return service_handler;
@@ -141,36 +233,99 @@ public:
   {
     BOOST_ASSERT(handler_ptr != 0);
 
+    // The handler bound by get_service_handler is no longer active.
+    if (handler_ptr->io_service_ != 0)
+      --load_;
+
     // Release and reset temporary variables.
     handler_ptr->clear();
 
-    // Lock for synchronize access to data.
-    scoped_lock_t lock(mutex_);
+    // Put back to the shared list at once if the pool has been exhausted, and wake up the waiter.
+    if (!closed_ && exhausted_ && exhausted_.exchange(false))
+    {
+      // Keep the handler in the cache of the calling thread if the shared list is full, the waiter can steal it.
+      if (service_handlers_.bounded_push(handler_ptr))
+        ++free_count_;
+      else
+        cache_handler(handler_ptr);
 
-    // Push this handler into the pool.
-    if (!push_handler(handler_ptr))
-      --handler_count_;
+      release_callback_t callback;
+
+      {
+        // Lock for synchronize access to data.
+        boost::mutex::scoped_lock lock(release_mutex_);
+
+        callback = release_callback_;
+        if (callback)
+          ++releasing_;
+      }
+
+      // Execute the callback without lock, it may get handlers from the pool in other threads.
+      if (callback)
+      {
+        callback();
+
+        // Lock for synchronize access to data.
+        boost::mutex::scoped_lock lock(release_mutex_);
+
+        // Wake up set_release_callback waiting for the callbacks in progress.
+        if (--releasing_ == 0)
+          release_condition_.notify_all();
+      }
+
+      return;
+    }
+
+    // Put back to the cache of the calling thread.
+    if (!closed_)
+    {
+      cache_handler(handler_ptr);
+      return;
+    }
+
+    destroy_handler(handler_ptr);
+    --handler_count_;
   }
 
-  /// Get the number of active handlers.
+  /// Get the number of active handlers, without lock.
   size_t get_load(void)
   {
-    // Lock for synchronize access to data.
-    scoped_lock_t lock(mutex_);
-
-    return (handler_count_ - service_handlers_.size());
+    return static_cast<size_t>(load_);
   }
 
-  /// Get the count of the handlers.
+  /// Get the count of the handlers, without lock.
   size_t handler_count(void)
   {
-    // Lock for synchronize access to data.
-    scoped_lock_t lock(mutex_);
-
-    return handler_count_;
+    return static_cast<size_t>(handler_count_);
   }
 
 private:
+  /// Put a handler to the cache of the calling thread, give half of the cache to the shared list if it is full.
+  ///   The handlers given are the oldest ones, so the handler just put is always kept.
+  void cache_handler(service_handler_t* handler_ptr)
+  {
+    handler_cache& cache = this->cache();
+
+    // Lock for synchronize access to the cache, only contended when stealing or clearing.
+    scoped_lock_t lock(cache.mutex);
+
+    cache.handlers.push_back(handler_ptr);
+    ++cached_count_;
+
+    // Give half of the cache to other threads if it is full.
+    if (cache.handlers.size() >= BAS_HANDLER_POOL_THREAD_CACHE)
+    {
+      size_t count = cache.handlers.size() - BAS_HANDLER_POOL_THREAD_CACHE / 2;
+      for (size_t i = 0; i < count; ++i)
+      {
+        --cached_count_;
+        push_handler(cache.handlers[i]);
+      }
+
+      cache.handlers.erase(cache.handlers.begin(), cache.handlers.begin() + count);
+    }
+  }
+
   /// Get the allocator for work.
   work_allocator_t& work_allocator(void)
   {
@@ -182,22 +337,50 @@ private:
   /// Release handlers in the pool.
   void clear(void)
   {
+    // Handlers put back after closed are deleted.
+    closed_ = true;
+
+    drain();
+  }
+
+  /// Delete handlers in the shared list and all caches.
+  void drain(void)
+  {
+    service_handler_t* handler_ptr = 0;
+    while (service_handlers_.pop(handler_ptr))
+    {
+      --free_count_;
+      destroy_handler(handler_ptr);
+      --handler_count_;
+    }
+
     // Lock for synchronize access to data.
     scoped_lock_t lock(mutex_);
 
-    if (closed_)
-      return;
-
-    closed_ = true;
+    for (size_t i = 0; i < caches_.size(); ++i)
+    {
+      // Lock for synchronize access to the cache.
+      scoped_lock_t cache_lock(caches_[i]->mutex);
 
-    for (size_t i = service_handlers_.size(); i > 0; --i)
-      service_handlers_[i - 1].reset();
+      for (size_t j = 0; j < caches_[i]->handlers.size(); ++j)
+      {
+        --cached_count_;
+        destroy_handler(caches_[i]->handlers[j]);
+        --handler_count_;
+      }
 
-    service_handlers_.clear();
+      caches_[i]->handlers.clear();
+    }
   }
-  
+
   /// Make a new handler.
   service_handler_t* make_handler(void)
+  {
+    return make_handler(typename work_allocator_traits<work_allocator_t>::contiguous());
+  }
+
+  /// Make a new handler, the work handler and sockets are in separate heap memory.
+  service_handler_t* make_handler(boost::false_type)
   {
     return new service_handler_t(work_allocator().make_handler(),
                                  read_buffer_size_,
@@ -206,36 +389,219 @@ private:
                                  io_timeout_);
   }
 
-  /// Push a handler into the pool.
-  bool push_handler(service_handler_t* handler_ptr)
+  /// Make a new handler, the work handler and sockets are in one block with the handler.
+  ///   The layout of the block is service_handler | work_handler | socket.
+  ///   If any construction throws, what has been constructed is destructed and the block is freed.
+  service_handler_t* make_handler(boost::true_type)
   {
-    if (handler_ptr == 0)
-      return false;
-    
-    // If the pool has exceed high_water_mark or been closed, delete this handler.
-    if (closed_ || (service_handlers_.size() >= pool_high_watermark_))
+    typedef typename service_handler_t::work_handler_t work_handler_t;
+    typedef typename service_handler_t::socket_t socket_t;
+
+    size_t work_offset = align(sizeof(service_handler_t), boost::alignment_of<work_handler_t>::value);
+    size_t socket_offset = align(work_offset + sizeof(work_handler_t), boost::alignment_of<socket_t>::value);
+
+    char* block = static_cast<char*>(::operator new(socket_offset + sizeof(socket_t)));
+    work_handler_t* work_handler = 0;
+
+    try
+    {
+      work_handler = work_allocator().make_handler(block + work_offset);
+
+      return new (block) service_handler_t(work_handler,
+                                           read_buffer_size_,
+                                           write_buffer_size_,
+                                           session_timeout_,
+                                           io_timeout_,
+                                           block + socket_offset);
+    }
+    catch (...)
+    {
+      if (work_handler != 0)
+        work_handler->~work_handler_t();
+
+      ::operator delete(block);
+      throw;
+    }
+  }
+
+  /// Round up size to a multiple of alignment.
+  static size_t align(size_t size, size_t alignment)
+  {
+    return (size + alignment - 1) / alignment * alignment;
+  }
+
+  /// Delete a handler made by make_handler.
+  static void destroy_handler(service_handler_t* handler_ptr)
+  {
+    handler_ptr->~service_handler_t();
+    ::operator delete(handler_ptr);
+  }
+
+  /// Push a handler into the shared list, delete it if the list has exceeded high_water_mark.
+  void push_handler(service_handler_t* handler_ptr)
+  {
+    if (service_handlers_.bounded_push(handler_ptr))
+      ++free_count_;
+    else
+    {
+      destroy_handler(handler_ptr);
+      --handler_count_;
+    }
+  }
+
+  /// Create handlers to the shared list, return the number created.
+  ///   Creation is serialized for Work_Allocator::make_handler, but not with getting and putting handlers.
+  size_t create_handler(size_t count)
+  {
+    // Lock for synchronize access to work allocator.
+    scoped_lock_t lock(create_mutex_);
+
+    size_t created = 0;
+    for (; created < count; ++created)
+    {
+      // Handler count can't exceed maximum.
+      if (static_cast<size_t>(++handler_count_) > pool_maximum_)
+      {
+        --handler_count_;
+        break;
+      }
+
+      push_handler(make_handler());
+    }
+
+    return created;
+  }
+
+  /// Create one handler for the caller, return 0 if handler count has reached maximum.
+  service_handler_t* create_one(void)
+  {
+    // Lock for synchronize access to work allocator.
+    scoped_lock_t lock(create_mutex_);
+
+    // Handler count can't exceed maximum.
+    if (static_cast<size_t>(++handler_count_) > pool_maximum_)
     {
-      delete handler_ptr;
+      --handler_count_;
+      return 0;
+    }
+
+    return make_handler();
+  }
+
+  /// Refill the shared list in the io_service of the maintenance task, if it is running.
+  void refill(void)
+  {
+    // Only one refill is in progress.
+    if (refilling_.exchange(true))
+      return;
+
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
 
-      return false;
+    if (maintain_timer_.get() == 0)
+    {
+      refilling_ = false;
+      return;
     }
 
-    service_handler_ptr service_handler(handler_ptr,
-                                        bind(&service_handler_pool::put_handler,
-                                             shared_from_this(),
-                                             _1));
+    maintain_service_->post(boost::bind(&service_handler_pool::handle_refill,
+                                        shared_from_this()));
+  }
+
+  /// Create an increment of handlers to the shared list.
+  void handle_refill(void)
+  {
+    if (!closed_)
+      create_handler(pool_increment_);
+
+    refilling_ = false;
+  }
 
-    service_handlers_.push_back(service_handler);
+  /// Get the number of handlers in the shared list.
+  size_t free_count(void)
+  {
+    // Count may be negative for a moment when a handler is popped before its push is counted.
+    long count = free_count_;
 
-    return true;
+    return (count < 0) ? 0 : static_cast<size_t>(count);
   }
 
-  /// Create handlers to the pool.
-  void create_handler(size_t count)
+  /// Get the number of handlers in the caches of all threads.
+  size_t cached_count(void)
   {
-    for (size_t i = 0; i < count; ++i)
-      if (push_handler(make_handler()))
-        ++handler_count_;
+    long count = cached_count_;
+
+    return (count < 0) ? 0 : static_cast<size_t>(count);
+  }
+
+  /// Wait for the next maintenance, caller must hold mutex_.
+  void arm_maintenance(void)
+  {
+    maintain_timer_->expires_from_now(boost::posix_time::milliseconds(maintain_interval_));
+    maintain_timer_->async_wait(bind(&service_handler_pool::handle_maintenance,
+                                     shared_from_this(),
+                                     boost::asio::placeholders::error));
+  }
+
+  /// Handle the maintenance timer.
+  void handle_maintenance(const boost::system::error_code& ec)
+  {
+    if (ec == boost::asio::error::operation_aborted)
+      return;
+
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(mutex_);
+
+      if (maintain_timer_.get() == 0 || closed_)
+        return;
+    }
+
+    maintain();
+
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    if (maintain_timer_.get() != 0)
+      arm_maintenance();
+  }
+
+  /// Create handlers ahead of the load trend, or delete idle handlers gradually.
+  void maintain(void)
+  {
+    size_t load = get_load();
+    size_t growth = (load > last_load_) ? load - last_load_ : 0;
+    last_load_ = load;
+
+    // Keep enough free handlers for the growth of next ticks, at least one increment,
+    //   but no more than the shared list can hold besides the handlers in use.
+    size_t target = pool_low_watermark_ + (std::max)(growth * BAS_HANDLER_POOL_PREWARM_TICKS, pool_increment_);
+    size_t limit = (pool_high_watermark_ > load) ? pool_high_watermark_ - load : 0;
+    target = (std::min)(target, limit);
+    size_t free = free_count();
+    if (free < target)
+    {
+      create_handler((std::min)(target - free, pool_increment_));
+      return;
+    }
+
+    // Delete a few idle handlers each time when the load is not growing, handlers in caches are idle too.
+    if (growth != 0 || free + cached_count() <= target + pool_increment_)
+      return;
+
+    size_t step = (std::max)(pool_increment_ / 10, static_cast<size_t>(1));
+    for (size_t i = 0; i < step && handler_count() > pool_init_size_; ++i)
+    {
+      // Take from the shared list first, then from the caches when the shared list is kept at target.
+      service_handler_t* handler_ptr = 0;
+      if (free_count() > target && service_handlers_.pop(handler_ptr))
+        --free_count_;
+      else if ((handler_ptr = steal_handler()) == 0)
+        break;
+
+      destroy_handler(handler_ptr);
+      --handler_count_;
+    }
   }
 
   /// Get a handler from the pool.
@@ -244,37 +610,199 @@ private:
   {
     service_handler_ptr service_handler;
 
+    if (closed_)
+      return service_handler;
+
+    service_handler_t* handler_ptr = pop_handler();
+    if (handler_ptr == 0)
+    {
+      // Ask the next handler put back to wake up the waiter.
+      exhausted_ = true;
+      return service_handler;
+    }
+
+    service_handler.reset(handler_ptr,
+                          bind(&service_handler_pool::put_handler,
+                               shared_from_this(),
+                               _1));
+
+    return service_handler;
+  }
+
+  /// Pop a handler from the cache of the calling thread, refill the cache if it is empty.
+  service_handler_t* pop_handler(void)
+  {
+    handler_cache& cache = this->cache();
+
+    {
+      // Lock for synchronize access to the cache, only contended when stealing or clearing.
+      scoped_lock_t lock(cache.mutex);
+
+      if (!cache.handlers.empty())
+      {
+        service_handler_t* handler_ptr = cache.handlers.back();
+        cache.handlers.pop_back();
+        --cached_count_;
+        return handler_ptr;
+      }
+    }
+
+    // Add new handlers in background if the pool is in low water mark.
+    if (free_count() <= pool_low_watermark_)
+      refill();
+
+    // Steal a handler idle in the cache of other threads if the shared list is empty,
+    //   create only one for the caller if none is found, the others are created by refill.
+    service_handler_t* handler_ptr = 0;
+    if (!service_handlers_.pop(handler_ptr))
+    {
+      handler_ptr = steal_handler();
+      return (handler_ptr != 0) ? handler_ptr : create_one();
+    }
+
+    // Refill the cache with half of its size from the shared list.
+    --free_count_;
+
+    // Lock for synchronize access to the cache.
+    scoped_lock_t lock(cache.mutex);
+
+    service_handler_t* cached = 0;
+    while (cache.handlers.size() < BAS_HANDLER_POOL_THREAD_CACHE / 2 && service_handlers_.pop(cached))
+    {
+      --free_count_;
+      cache.handlers.push_back(cached);
+      ++cached_count_;
+    }
+
+    return handler_ptr;
+  }
+
+  /// Take a handler from the cache of any thread, when the shared list is empty.
+  service_handler_t* steal_handler(void)
+  {
+    // No handler is cached by any thread.
+    if (cached_count_ == 0)
+      return 0;
+
     // Lock for synchronize access to data.
     scoped_lock_t lock(mutex_);
 
-    if (!closed_)
+    for (size_t i = 0; i < caches_.size(); ++i)
     {
-      // Add new handler if the pool is in low water mark and handler count not exceed maximum.
-      if (service_handlers_.size() <= pool_low_watermark_ && handler_count_ < pool_maximum_)
-        create_handler(pool_increment_);
+      // Lock for synchronize access to the cache.
+      scoped_lock_t cache_lock(caches_[i]->mutex);
 
-      if (!service_handlers_.empty())
+      if (!caches_[i]->handlers.empty())
       {
-        service_handler = service_handlers_.back();
-        service_handlers_.pop_back();
+        service_handler_t* handler_ptr = caches_[i]->handlers.back();
+        caches_[i]->handlers.pop_back();
+        --cached_count_;
+        return handler_ptr;
       }
     }
 
-    return service_handler;
+    return 0;
+  }
+
+  /// The handlers cached by a thread.
+  struct handler_cache
+  {
+    /// Mutex for synchronize access to the cache.
+    mutex_t mutex;
+
+    /// The handlers in the cache.
+    std::vector<service_handler_t*> handlers;
+  };
+
+  typedef boost::shared_ptr<handler_cache> handler_cache_ptr;
+
+  /// Get the cache of the calling thread.
+  handler_cache& cache(void)
+  {
+    handler_cache* cache_ptr = cache_.get();
+    if (cache_ptr == 0)
+    {
+      handler_cache_ptr new_cache(new handler_cache);
+
+      {
+        // Lock for synchronize access to data.
+        scoped_lock_t lock(mutex_);
+
+        caches_.push_back(new_cache);
+      }
+
+      cache_ptr = new_cache.get();
+      cache_.reset(cache_ptr);
+    }
+
+    return *cache_ptr;
+  }
+
+  /// Caches are owned by the pool, nothing to do when the thread exits.
+  static void no_cleanup(handler_cache*)
+  {
   }
 
 private:
-  /// Mutex for synchronize access to data.
+  /// Mutex for synchronize access to the caches list.
   mutex_t mutex_;
 
+  /// Mutex for synchronize creating handlers.
+  mutex_t create_mutex_;
+
   /// Count of service_handler.
-  size_t handler_count_;
+  boost::detail::atomic_count handler_count_;
+
+  /// Count of active service_handler.
+  boost::detail::atomic_count load_;
 
   // Flag to indicate that the pool has been closed and all handlers need to be deleted.
-  bool closed_;
+  boost::atomic<bool> closed_;
+
+  /// The free handlers shared by all threads, bounded by high water mark.
+  boost::lockfree::stack<service_handler_t*> service_handlers_;
+
+  /// Count of handlers in the shared list.
+  boost::detail::atomic_count free_count_;
+
+  /// Count of handlers in the caches of all threads.
+  boost::detail::atomic_count cached_count_;
+
+  /// The cache of each thread.
+  boost::thread_specific_ptr<handler_cache> cache_;
+
+  /// All caches created, for deleting handlers in them.
+  std::vector<handler_cache_ptr> caches_;
+
+  /// The io_service of the maintenance task.
+  boost::asio::io_service* maintain_service_;
+
+  /// Timer for the maintenance task.
+  boost::shared_ptr<boost::asio::deadline_timer> maintain_timer_;
+
+  /// The interval of maintenance in milliseconds.
+  unsigned int maintain_interval_;
+
+  /// Flag to indicate that a refill has been posted to the io_service of the maintenance task.
+  boost::atomic<bool> refilling_;
+
+  /// The load at the last maintenance.
+  size_t last_load_;
+
+  /// Mutex for synchronize access to the release callback.
+  boost::mutex release_mutex_;
+
+  /// Condition to wake up set_release_callback when no callback is in progress.
+  boost::condition release_condition_;
+
+  /// The callback executed when a handler is put back to an exhausted pool.
+  release_callback_t release_callback_;
+
+  /// Number of release callbacks in progress.
+  size_t releasing_;
 
-  /// The pool of service_handler.
-  std::vector<service_handler_ptr> service_handlers_;
+  /// Flag to indicate that a handler has been requested from an exhausted pool.
+  boost::atomic<bool> exhausted_;
 
   /// The allocator of work_handler.
   work_allocator_ptr work_allocator_;
@@ -0,0 +1,263 @@
+//
+// slab_pool.hpp
+// ~~~~~~~~~~~~~
+//
+// Copyright (c) 2012 Xu Ye Jun (moore.xu@gmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BAS_SLAB_POOL_HPP
+#define BAS_SLAB_POOL_HPP
+
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/thread/tss.hpp>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace bas {
+
+#define BAS_SLAB_SIZE            4096
+#define BAS_SLAB_MIN_SIZE        64
+#define BAS_SLAB_CLASSES         14
+#define BAS_SLAB_THREAD_CACHE    32
+#define BAS_SLAB_HIGH_WATERMARK  (16 * 1024 * 1024)
+
+/// Pool of memory blocks in size classes, released blocks are kept for reusing.
+///   Size classes are BAS_SLAB_MIN_SIZE, 2 * BAS_SLAB_MIN_SIZE, 4 * BAS_SLAB_MIN_SIZE ... , larger blocks are not pooled.
+///   Each thread keeps a few blocks of each class without lock, others are shared by all threads.
+///   Shared blocks of a class above BAS_SLAB_HIGH_WATERMARK bytes are freed.
+///   The pool must be destroyed after all threads using it are finished.
+class slab_pool
+  : private boost::noncopyable
+{
+public:
+  /// Define type reference of boost::asio::detail::mutex.
+  typedef boost::asio::detail::mutex mutex_t;
+
+  /// Define type reference of boost::asio::detail::mutex::scoped_lock.
+  typedef boost::asio::detail::mutex::scoped_lock scoped_lock_t;
+
+  /// Define type reference of std::size_t.
+  typedef std::size_t size_t;
+
+  /// Constructor.
+  explicit slab_pool(size_t slab_size = BAS_SLAB_SIZE)
+    : mutex_(),
+      slab_size_(slab_size),
+      cache_()
+  {
+  }
+
+  /// Destruct the pool, free all blocks kept.
+  ~slab_pool()
+  {
+    // Put back blocks of the calling thread.
+    cache_.reset();
+
+    for (size_t i = 0; i < BAS_SLAB_CLASSES; ++i)
+      for (size_t j = 0; j < free_[i].size(); ++j)
+        ::operator delete(free_[i][j]);
+  }
+
+  /// Get the size of the blocks used by buffer_chain.
+  size_t slab_size() const
+  {
+    return slab_size_;
+  }
+
+  /// Get a block of slab_size, can be call from any thread.
+  void* allocate()
+  {
+    return allocate(slab_size_);
+  }
+
+  /// Put back a block of slab_size, can be call from any thread.
+  void deallocate(void* slab)
+  {
+    deallocate(slab, slab_size_);
+  }
+
+  /// Get a block of at least size bytes, can be call from any thread.
+  void* allocate(size_t size)
+  {
+    size_t index = size_class(size);
+    if (index == BAS_SLAB_CLASSES)
+      return ::operator new(size);
+
+    // Refill the cache of the calling thread from the shared blocks.
+    std::vector<void*>& cached = cache()[index];
+    if (cached.empty())
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(mutex_);
+
+      std::vector<void*>& shared = free_[index];
+      while (!shared.empty() && cached.size() < BAS_SLAB_THREAD_CACHE / 2)
+      {
+        cached.push_back(shared.back());
+        shared.pop_back();
+      }
+    }
+
+    if (cached.empty())
+      return ::operator new(class_size(index));
+
+    void* slab = cached.back();
+    cached.pop_back();
+    return slab;
+  }
+
+  /// Put back a block allocated with the same size, can be call from any thread.
+  void deallocate(void* slab, size_t size)
+  {
+    size_t index = size_class(size);
+    if (index == BAS_SLAB_CLASSES)
+    {
+      ::operator delete(slab);
+      return;
+    }
+
+    std::vector<void*>& cached = cache()[index];
+    cached.push_back(slab);
+
+    // Share half of the cache with other threads if it is full.
+    if (cached.size() >= BAS_SLAB_THREAD_CACHE)
+      share(index, cached, BAS_SLAB_THREAD_CACHE / 2);
+  }
+
+  /// Get the pool shared by all buffers.
+  static slab_pool& global()
+  {
+    static boost::once_flag flag = BOOST_ONCE_INIT;
+    boost::call_once(flag, &slab_pool::create_global);
+
+    return *global_instance();
+  }
+
+private:
+  /// The blocks kept by a thread.
+  class thread_cache
+    : private boost::noncopyable
+  {
+  public:
+    /// Constructor.
+    explicit thread_cache(slab_pool& pool)
+      : pool_(pool)
+    {
+    }
+
+    /// Put back all blocks to the pool when the thread exits.
+    ~thread_cache()
+    {
+      for (size_t i = 0; i < BAS_SLAB_CLASSES; ++i)
+        pool_.share(i, free_[i], 0);
+    }
+
+    /// Get the blocks of the given class.
+    std::vector<void*>& operator[](size_t index)
+    {
+      return free_[index];
+    }
+
+  private:
+    /// The pool of the blocks.
+    slab_pool& pool_;
+
+    /// The blocks of each class.
+    std::vector<void*> free_[BAS_SLAB_CLASSES];
+  };
+
+  /// Get the index of the smallest class for the size, BAS_SLAB_CLASSES if too large.
+  static size_t size_class(size_t size)
+  {
+    size_t index = 0;
+    while (index < BAS_SLAB_CLASSES && class_size(index) < size)
+      ++index;
+
+    return index;
+  }
+
+  /// Get the block size of the class.
+  static size_t class_size(size_t index)
+  {
+    return static_cast<size_t>(BAS_SLAB_MIN_SIZE) << index;
+  }
+
+  /// Move blocks of a thread cache to the shared blocks until keep blocks are left in the cache,
+  ///   and free the shared blocks above the high watermark.
+  void share(size_t index, std::vector<void*>& cached, size_t keep)
+  {
+    std::vector<void*> excess;
+
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(mutex_);
+
+      std::vector<void*>& shared = free_[index];
+      while (cached.size() > keep)
+      {
+        shared.push_back(cached.back());
+        cached.pop_back();
+      }
+
+      size_t limit = BAS_SLAB_HIGH_WATERMARK / class_size(index);
+      if (limit < BAS_SLAB_THREAD_CACHE)
+        limit = BAS_SLAB_THREAD_CACHE;
+
+      if (shared.size() > limit)
+      {
+        excess.assign(shared.begin() + limit, shared.end());
+        shared.resize(limit);
+      }
+    }
+
+    // Free without lock.
+    for (size_t i = 0; i < excess.size(); ++i)
+      ::operator delete(excess[i]);
+  }
+
+  /// Get the cache of the calling thread.
+  thread_cache& cache()
+  {
+    if (cache_.get() == 0)
+      cache_.reset(new thread_cache(*this));
+
+    return *cache_;
+  }
+
+  /// Create the shared pool once, never destroyed for buffers and thread caches released
+  ///   during static destruction or after it.
+  static void create_global()
+  {
+    global_instance() = new slab_pool;
+  }
+
+  /// Get the pointer of the shared pool.
+  static slab_pool*& global_instance()
+  {
+    static slab_pool* instance = 0;
+    return instance;
+  }
+
+private:
+  /// Mutex for synchronize access to data.
+  mutex_t mutex_;
+
+  /// The size of the blocks used by buffer_chain.
+  size_t slab_size_;
+
+  /// The blocks shared by all threads of each class.
+  std::vector<void*> free_[BAS_SLAB_CLASSES];
+
+  /// The blocks kept by each thread.
+  boost::thread_specific_ptr<thread_cache> cache_;
+};
+
+} // namespace bas
+
+#endif // BAS_SLAB_POOL_HPP
@@ -0,0 +1,237 @@
+//
+// thread_affinity.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2012 Xu Ye Jun (moore.xu@gmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BAS_THREAD_AFFINITY_HPP
+#define BAS_THREAD_AFFINITY_HPP
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/once.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace bas {
+
+/// Helper for binding threads to processors and querying NUMA nodes.
+class thread_affinity
+{
+public:
+  /// Define type reference of processor list.
+  typedef std::vector<int> processors_t;
+
+  /// Define type reference of processor list of each NUMA node.
+  typedef std::vector<processors_t> nodes_t;
+
+  /// Get the number of processors.
+  static size_t processor_count()
+  {
+    size_t count = boost::thread::hardware_concurrency();
+
+    return (count == 0) ? 1 : count;
+  }
+
+  /// Bind the calling thread to the given processor.
+  static bool bind(int processor)
+  {
+    if (processor < 0)
+      return false;
+
+#if defined(__linux__)
+    // Allocate the set for the processor, a fixed cpu_set_t only holds CPU_SETSIZE processors.
+    cpu_set_t* cpu_set = CPU_ALLOC(processor + 1);
+    if (cpu_set == 0)
+      return false;
+
+    size_t size = CPU_ALLOC_SIZE(processor + 1);
+    CPU_ZERO_S(size, cpu_set);
+    CPU_SET_S(processor, size, cpu_set);
+
+    bool bound = pthread_setaffinity_np(pthread_self(), size, cpu_set) == 0;
+    CPU_FREE(cpu_set);
+
+    return bound;
+#elif defined(BOOST_WINDOWS)
+    if (processor >= static_cast<int>(sizeof(DWORD_PTR) * 8))
+      return false;
+
+    return ::SetThreadAffinityMask(::GetCurrentThread(), static_cast<DWORD_PTR>(1) << processor) != 0;
+#else
+    return false;
+#endif
+  }
+
+  /// Get processors of each NUMA node, all processors are in one node if NUMA is not available.
+  ///   The topology is read once and cached.
+  static nodes_t nodes()
+  {
+    return get_topology().nodes;
+  }
+
+  /// Get the NUMA node of the given processor, return -1 if unknown.
+  static int node_of(int processor)
+  {
+    const topology_t& topology = get_topology();
+    if (processor < 0 || static_cast<size_t>(processor) >= topology.node_of.size())
+      return -1;
+
+    return topology.node_of[processor];
+  }
+
+private:
+  /// The cached NUMA topology.
+  struct topology_t
+  {
+    /// Processors of each NUMA node.
+    nodes_t nodes;
+
+    /// The NUMA node of each processor, -1 if unknown.
+    std::vector<int> node_of;
+  };
+
+  /// Get the cached NUMA topology, it is loaded by the first caller.
+  static const topology_t& get_topology()
+  {
+    static boost::once_flag once = BOOST_ONCE_INIT;
+    boost::call_once(&thread_affinity::load_topology, once);
+
+    return topology();
+  }
+
+  /// Storage of the cached NUMA topology.
+  static topology_t& topology()
+  {
+    static topology_t topology;
+
+    return topology;
+  }
+
+  /// Load the NUMA topology and build the processor to node map.
+  static void load_topology()
+  {
+    topology_t& topology = thread_affinity::topology();
+    topology.nodes = read_nodes();
+
+    for (size_t i = 0; i < topology.nodes.size(); ++i)
+    {
+      for (size_t j = 0; j < topology.nodes[i].size(); ++j)
+      {
+        size_t processor = static_cast<size_t>(topology.nodes[i][j]);
+        if (processor >= topology.node_of.size())
+          topology.node_of.resize(processor + 1, -1);
+
+        topology.node_of[processor] = static_cast<int>(i);
+      }
+    }
+  }
+
+  /// Read processors of each NUMA node from the system.
+  static nodes_t read_nodes()
+  {
+    nodes_t nodes;
+
+#if defined(__linux__)
+    // Node numbers may be not contiguous, for example with offline or hot-plugged nodes.
+    std::vector<int> numbers;
+    DIR* dir = ::opendir("/sys/devices/system/node");
+    if (dir != 0)
+    {
+      while (struct dirent* entry = ::readdir(dir))
+      {
+        int number = 0;
+        char tail = 0;
+        if (std::sscanf(entry->d_name, "node%d%c", &number, &tail) == 1 && number >= 0)
+          numbers.push_back(number);
+      }
+
+      ::closedir(dir);
+    }
+
+    std::sort(numbers.begin(), numbers.end());
+
+    for (size_t n = 0; n < numbers.size(); ++n)
+    {
+      char path[64];
+      std::sprintf(path, "/sys/devices/system/node/node%d/cpulist", numbers[n]);
+
+      FILE* file = std::fopen(path, "r");
+      if (file == 0)
+        continue;
+
+      // The format of cpulist likes "0-3,8-11".
+      processors_t processors;
+      int first = 0;
+      while (std::fscanf(file, "%d", &first) == 1)
+      {
+        int last = first;
+        int c = std::fgetc(file);
+        if (c == '-')
+        {
+          if (std::fscanf(file, "%d", &last) != 1)
+            break;
+
+          c = std::fgetc(file);
+        }
+
+        for (int i = first; i <= last; ++i)
+          processors.push_back(i);
+
+        if (c != ',')
+          break;
+      }
+
+      std::fclose(file);
+
+      if (!processors.empty())
+        nodes.push_back(processors);
+    }
+#elif defined(BOOST_WINDOWS) && (_WIN32_WINNT >= 0x0600)
+    ULONG highest = 0;
+    if (::GetNumaHighestNodeNumber(&highest))
+    {
+      for (ULONG node = 0; node <= highest; ++node)
+      {
+        ULONGLONG mask = 0;
+        if (!::GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask))
+          continue;
+
+        processors_t processors;
+        for (int i = 0; i < 64; ++i)
+          if (mask & (static_cast<ULONGLONG>(1) << i))
+            processors.push_back(i);
+
+        if (!processors.empty())
+          nodes.push_back(processors);
+      }
+    }
+#endif
+
+    if (nodes.empty())
+    {
+      processors_t processors;
+      for (size_t i = 0; i < processor_count(); ++i)
+        processors.push_back(static_cast<int>(i));
+
+      nodes.push_back(processors);
+    }
+
+    return nodes;
+  }
+};
+
+} // namespace bas
+
+#endif // BAS_THREAD_AFFINITY_HPP
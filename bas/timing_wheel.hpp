@@ -0,0 +1,352 @@
+//
+// timing_wheel.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2012 Xu Ye Jun (moore.xu@gmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BAS_TIMING_WHEEL_HPP
+#define BAS_TIMING_WHEEL_HPP
+
+#include <boost/asio.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <vector>
+
+namespace bas {
+
+#define BAS_TIMING_WHEEL_SLOTS  512
+
+/// Service for tracking timeouts of an io_service with a coarse-grained timing wheel.
+///   Use boost::asio::use_service<timing_wheel>(io_service) to get it.
+///   The wheel ticks every second while any entry is scheduled, expired callbacks are executed in io_service thread.
+///   Re-arming an entry to a later time only updates its deadline without lock, the entry is moved when its slot is reached.
+class timing_wheel
+  : public boost::asio::detail::service_base<timing_wheel>
+{
+public:
+  /// Define type reference of boost::asio::detail::mutex.
+  typedef boost::asio::detail::mutex mutex_t;
+
+  /// Define type reference of boost::asio::detail::mutex::scoped_lock.
+  typedef boost::asio::detail::mutex::scoped_lock scoped_lock_t;
+
+  /// The type of the callback executed when an entry expires.
+  typedef boost::function<void ()> callback_t;
+
+  /// The timeouts of an object tracked by the wheel.
+  class entry
+    : private boost::noncopyable
+  {
+  public:
+    /// Constructor.
+    explicit entry(const callback_t& callback)
+      : callback_(callback),
+        session_(0),
+        io_(0),
+        scheduled_(0)
+    {
+    }
+
+  private:
+    friend class timing_wheel;
+
+    /// The callback executed when the entry expires.
+    callback_t callback_;
+
+    /// The tick of session timeout, 0 if not set.
+    boost::atomic<std::size_t> session_;
+
+    /// The tick of i/o operation timeout, 0 if not set.
+    boost::atomic<std::size_t> io_;
+
+    /// The tick of the slot holding the entry, 0 if not scheduled. Only changed with the lock.
+    boost::atomic<std::size_t> scheduled_;
+  };
+
+  typedef boost::shared_ptr<entry> entry_ptr;
+
+  /// Constructor.
+  explicit timing_wheel(boost::asio::io_service& io_service)
+    : boost::asio::detail::service_base<timing_wheel>(io_service),
+      mutex_(),
+      timer_(io_service),
+      slots_(BAS_TIMING_WHEEL_SLOTS),
+      start_(boost::posix_time::microsec_clock::universal_time()),
+      tick_(0),
+      count_(0),
+      armed_(false)
+  {
+  }
+
+  /// Destroy all user-defined handler objects owned by the service.
+  void shutdown_service()
+  {
+    shutdown();
+  }
+
+  /// Destroy all user-defined handler objects owned by the service, for newer asio.
+  void shutdown()
+  {
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    for (std::size_t i = slots_.size(); i > 0; --i)
+      slots_[i - 1].clear();
+
+    count_ = 0;
+  }
+
+  /// Create an entry with the callback executed when it expires.
+  entry_ptr make_entry(const callback_t& callback)
+  {
+    return entry_ptr(new entry(callback));
+  }
+
+  /// Set session timeout of the entry, 0 to cancel. Can be call from any thread.
+  void set_session(const entry_ptr& e, unsigned int seconds)
+  {
+    set(e, e->session_, seconds);
+  }
+
+  /// Set i/o operation timeout of the entry, 0 to cancel. Can be call from any thread.
+  void set_io(const entry_ptr& e, unsigned int seconds)
+  {
+    set(e, e->io_, seconds);
+  }
+
+  /// Cancel all timeouts of the entry at once, so the wheel stops ticking without entries. Can be call from any thread.
+  void cancel(const entry_ptr& e)
+  {
+    e->session_ = 0;
+    e->io_ = 0;
+
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    schedule(e, tick_ + 1);
+  }
+
+private:
+  /// A copy of entry in a slot, it is stale if the entry has been scheduled to another tick.
+  struct slot_entry
+  {
+    entry_ptr e;
+    std::size_t tick;
+  };
+
+  typedef std::vector<slot_entry> slot_t;
+
+  /// Get the current tick.
+  std::size_t now() const
+  {
+    return static_cast<std::size_t>((boost::posix_time::microsec_clock::universal_time() - start_).total_seconds());
+  }
+
+  /// Get the earliest deadline of the entry, 0 if no timeout is set.
+  static std::size_t deadline(const entry& e)
+  {
+    std::size_t session = e.session_;
+    std::size_t io = e.io_;
+    if (session == 0 || (io != 0 && io < session))
+      return io;
+
+    return session;
+  }
+
+  /// Set a timeout of the entry, the lock is only taken when the entry must be scheduled earlier.
+  void set(const entry_ptr& e, boost::atomic<std::size_t>& timeout, unsigned int seconds)
+  {
+    std::size_t tick = (seconds == 0) ? 0 : now() + seconds;
+    timeout = tick;
+
+    // Cancelled or scheduled earlier, the entry is dropped or moved when its slot is reached.
+    //   If the slot is being processed, the new timeout is seen there after scheduled_ is reset.
+    std::size_t scheduled = e->scheduled_;
+    if (tick == 0 || (scheduled != 0 && scheduled <= tick))
+      return;
+
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    if (!armed_)
+      tick_ = now();
+
+    schedule(e, tick_ + 1);
+
+    // Start ticking if the wheel is idle.
+    if (!armed_ && count_ != 0)
+    {
+      armed_ = true;
+      arm();
+    }
+  }
+
+  /// Schedule the entry with its deadline but not before the earliest tick, caller must hold the lock.
+  void schedule(const entry_ptr& e, std::size_t earliest)
+  {
+    for (;;)
+    {
+      std::size_t tick = deadline(*e);
+      std::size_t scheduled = e->scheduled_;
+
+      // No timeout, the copy in slot becomes stale. Check again for a timeout set meanwhile.
+      if (tick == 0)
+      {
+        if (scheduled == 0)
+          return;
+
+        e->scheduled_ = 0;
+        --count_;
+        continue;
+      }
+
+      tick = (std::max)(tick, earliest);
+
+      // Scheduled earlier, it will be moved when the slot is reached.
+      if (scheduled != 0 && scheduled <= tick)
+        return;
+
+      if (scheduled == 0)
+        ++count_;
+
+      // Check again for an earlier timeout set before scheduled_ is updated.
+      insert(e, tick);
+    }
+  }
+
+  /// Put the entry into the slot of the given tick, caller must hold the lock.
+  void insert(const entry_ptr& e, std::size_t tick)
+  {
+    slot_entry copy;
+    copy.e = e;
+    copy.tick = tick;
+
+    e->scheduled_ = tick;
+    slots_[tick % slots_.size()].push_back(copy);
+  }
+
+  /// Wait for the next tick, caller must hold the lock.
+  void arm()
+  {
+    timer_.expires_at(start_ + boost::posix_time::seconds(static_cast<long>(tick_ + 1)));
+    timer_.async_wait(boost::bind(&timing_wheel::handle_tick,
+                                  this,
+                                  boost::asio::placeholders::error));
+  }
+
+  /// Handle the tick of the wheel in io_service thread.
+  void handle_tick(const boost::system::error_code& ec)
+  {
+    if (ec == boost::asio::error::operation_aborted)
+      return;
+
+    std::vector<callback_t> expired;
+
+    {
+      // Lock for synchronize access to data.
+      scoped_lock_t lock(mutex_);
+
+      // Process all slots passed, each slot is processed once at most.
+      std::size_t current = now();
+      std::size_t last = (current - tick_ > slots_.size()) ? current - slots_.size() : tick_;
+      for (std::size_t tick = last + 1; tick <= current; ++tick)
+        expire(tick, current, expired);
+
+      tick_ = current;
+    }
+
+    // Execute callbacks without lock, they may set timeouts again.
+    for (std::size_t i = 0; i < expired.size(); ++i)
+      expired[i]();
+
+    // Lock for synchronize access to data.
+    scoped_lock_t lock(mutex_);
+
+    // Stop ticking if no entry is scheduled, entries cancelled by the callbacks are not waited.
+    if (count_ != 0)
+      arm();
+    else
+      armed_ = false;
+  }
+
+  /// Process the slot of the given tick, caller must hold the lock.
+  void expire(std::size_t tick, std::size_t current, std::vector<callback_t>& expired)
+  {
+    slot_t slot;
+    slot.swap(slots_[tick % slots_.size()]);
+
+    for (std::size_t i = 0; i < slot.size(); ++i)
+    {
+      slot_entry& copy = slot[i];
+      entry& e = *copy.e;
+
+      // The entry has been scheduled to another tick, drop the stale copy.
+      if (copy.tick != e.scheduled_)
+        continue;
+
+      // The entry is scheduled in a later round, keep it.
+      if (copy.tick > current)
+      {
+        slots_[tick % slots_.size()].push_back(copy);
+        continue;
+      }
+
+      // Clear the expired timeouts, a timeout set again meanwhile is kept.
+      bool fired = clear_expired(e.session_, current);
+      fired = clear_expired(e.io_, current) || fired;
+
+      // Move the entry with the later timeouts, or drop it.
+      e.scheduled_ = 0;
+      --count_;
+      schedule(copy.e, current + 1);
+
+      // Expired, execute the callback.
+      if (fired)
+        expired.push_back(e.callback_);
+    }
+  }
+
+  /// Clear the timeout if it is expired, return false if it is not expired or set again.
+  static bool clear_expired(boost::atomic<std::size_t>& timeout, std::size_t current)
+  {
+    std::size_t tick = timeout;
+
+    return tick != 0 && tick <= current && timeout.compare_exchange_strong(tick, 0);
+  }
+
+private:
+  /// Mutex for synchronize access to data.
+  mutex_t mutex_;
+
+  /// Timer for ticking the wheel.
+  boost::asio::deadline_timer timer_;
+
+  /// The slots of the wheel.
+  std::vector<slot_t> slots_;
+
+  /// The start time of tick 0.
+  boost::posix_time::ptime start_;
+
+  /// The last processed tick.
+  std::size_t tick_;
+
+  /// The number of scheduled entries.
+  std::size_t count_;
+
+  /// Flag to indicate the timer is waiting for the next tick.
+  bool armed_;
+};
+
+} // namespace bas
+
+#endif // BAS_TIMING_WHEEL_HPP
@@ -0,0 +1,152 @@
+//
+// work_handler_traits.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2012 Xu Ye Jun (moore.xu@gmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BAS_WORK_HANDLER_TRAITS_HPP
+#define BAS_WORK_HANDLER_TRAITS_HPP
+
+#include <boost/mpl/bool.hpp>
+#include <boost/mpl/eval_if.hpp>
+#include <boost/mpl/has_xxx.hpp>
+#include <boost/mpl/identity.hpp>
+#include <boost/type_traits/integral_constant.hpp>
+#include <boost/type_traits/is_same.hpp>
+
+namespace bas {
+
+/// Tag for work handlers that may block, callbacks are executed in work_service thread.
+struct blocking_tag {};
+
+/// Tag for work handlers that never block, callbacks are executed inline in io_service thread.
+struct non_blocking_tag {};
+
+/// Tag for work allocators creating work handlers and sockets in separate heap memory.
+struct separate_tag {};
+
+/// Tag for work allocators creating work handlers and sockets in the memory of the service_handler, with:
+///   work_handler_t* make_handler(void* memory);
+///   socket_t* make_socket(boost::asio::io_service& io_service, void* memory);
+struct contiguous_tag {};
+
+/// Tag for work handlers that block sometimes, callbacks are executed inline in io_service thread
+///   while the moving average of their execution time is short, otherwise in work_service thread.
+struct adaptive_tag {};
+
+namespace detail {
+
+BOOST_MPL_HAS_XXX_TRAIT_NAMED_DEF(has_work_category, work_category, false)
+BOOST_MPL_HAS_XXX_TRAIT_NAMED_DEF(has_allocation_category, allocation_category, false)
+
+/// Define a trait to detect whether a class has a member function with the given name, in any signature.
+///   The name of the class combined with a base also has it is ambiguous only if the class has it.
+#define BAS_HAS_MEMBER_FUNCTION_DEF(trait, name) \
+  template<typename T> \
+  class trait \
+  { \
+    struct base { void name(); }; \
+    struct derived : T, base { derived(); }; \
+    template<typename U, U> struct check; \
+    template<typename D> static char test(check<void (base::*)(), &D::name>*); \
+    template<typename D> static char (&test(...))[2]; \
+  public: \
+    BOOST_STATIC_CONSTANT(bool, value = (sizeof(test<derived>(0)) == 2)); \
+    typedef boost::integral_constant<bool, value> type; \
+  };
+
+BAS_HAS_MEMBER_FUNCTION_DEF(has_on_read_batch, on_read_batch)
+BAS_HAS_MEMBER_FUNCTION_DEF(has_on_write, on_write)
+BAS_HAS_MEMBER_FUNCTION_DEF(has_on_clear, on_clear)
+BAS_HAS_MEMBER_FUNCTION_DEF(has_on_parent, on_parent)
+BAS_HAS_MEMBER_FUNCTION_DEF(has_on_child, on_child)
+BAS_HAS_MEMBER_FUNCTION_DEF(has_on_set_parent, on_set_parent)
+BAS_HAS_MEMBER_FUNCTION_DEF(has_on_set_child, on_set_child)
+BAS_HAS_MEMBER_FUNCTION_DEF(has_get_priority, get_priority)
+
+/// Get the work_category defined by the work handler.
+template<typename Work_Handler>
+struct get_work_category
+{
+  typedef typename Work_Handler::work_category type;
+};
+
+/// Get the allocation_category defined by the work allocator.
+template<typename Work_Allocator>
+struct get_allocation_category
+{
+  typedef typename Work_Allocator::allocation_category type;
+};
+
+} // namespace detail
+
+/// Traits of work handler.
+///   A work handler declares itself non-blocking with:
+///     typedef bas::non_blocking_tag work_category;
+///   Otherwise it is treated as blocking.
+///   Only on_open, on_read and on_close are required, the stages of other callbacks are removed
+///   if the work handler does not define them.
+template<typename Work_Handler>
+struct work_handler_traits
+{
+  /// The work category of the work handler.
+  typedef typename boost::mpl::eval_if<detail::has_work_category<Work_Handler>,
+      detail::get_work_category<Work_Handler>,
+      boost::mpl::identity<blocking_tag> >::type work_category;
+
+  /// Whether the callbacks of the work handler can be executed inline in io_service thread.
+  typedef boost::is_same<work_category, non_blocking_tag> non_blocking;
+
+  /// Whether the callbacks of the work handler are executed inline or not by their execution time.
+  typedef boost::is_same<work_category, adaptive_tag> adaptive;
+
+  /// Whether the work handler processes decoded frames together with on_read_batch.
+  typedef typename detail::has_on_read_batch<Work_Handler>::type read_batch;
+
+  /// Whether the work handler defines on_write, completed writes are not posted if not.
+  typedef typename detail::has_on_write<Work_Handler>::type handles_write;
+
+  /// Whether the work handler defines on_clear.
+  typedef typename detail::has_on_clear<Work_Handler>::type handles_clear;
+
+  /// Whether the work handler defines on_parent, events from the parent are dropped if not.
+  typedef typename detail::has_on_parent<Work_Handler>::type handles_parent;
+
+  /// Whether the work handler defines on_child, events from the child are dropped if not.
+  typedef typename detail::has_on_child<Work_Handler>::type handles_child;
+
+  /// Whether the work handler defines on_set_parent.
+  typedef typename detail::has_on_set_parent<Work_Handler>::type handles_set_parent;
+
+  /// Whether the work handler defines on_set_child.
+  typedef typename detail::has_on_set_child<Work_Handler>::type handles_set_child;
+
+  /// Whether the work handler defines get_priority, the priority of works of each accepted connection:
+  ///   bas::io_service_group::priority_t get_priority(service_handler_t& handler);
+  ///   It is called in io_service thread after accepted and before on_open, otherwise the priority of the server is used.
+  typedef typename detail::has_get_priority<Work_Handler>::type handles_priority;
+};
+
+/// Traits of work allocator.
+///   A work allocator declares placement construction with:
+///     typedef bas::contiguous_tag allocation_category;
+///   Otherwise work handlers and sockets are created in separate heap memory.
+template<typename Work_Allocator>
+struct work_allocator_traits
+{
+  /// The allocation category of the work allocator.
+  typedef typename boost::mpl::eval_if<detail::has_allocation_category<Work_Allocator>,
+      detail::get_allocation_category<Work_Allocator>,
+      boost::mpl::identity<separate_tag> >::type allocation_category;
+
+  /// Whether work handlers and sockets are created in the memory of the service_handler.
+  typedef boost::is_same<allocation_category, contiguous_tag> contiguous;
+};
+
+} // namespace bas
+
+#endif // BAS_WORK_HANDLER_TRAITS_HPP
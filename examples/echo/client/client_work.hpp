@@ -28,6 +28,9 @@ class client_work
 public:
   typedef bas::service_handler<client_work> client_handler_type;
 
+  /// The callbacks never block, execute them inline in io_service thread.
+  typedef bas::non_blocking_tag work_category;
+
   client_work(error_count& counter, unsigned int pause_time)
     : error_count_(counter),
       pause_time_(pause_time)
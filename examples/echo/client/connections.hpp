@@ -122,8 +122,7 @@ public:
     time_start = boost::posix_time::microsec_clock::universal_time();
 
     for (std::size_t i = 0; i < connection_number_; ++i)
-      client_.connect(service_group_.get(bas::io_service_group::io_pool).get_io_service(),
-          service_group_.get(bas::io_service_group::work_pool).get_io_service());
+      client_.connect(service_group_);
 
     time_long = boost::posix_time::microsec_clock::universal_time() - time_start;
     std::cout << "All connections created in " << time_long.total_milliseconds() << " ms.\n";